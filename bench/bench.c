@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * iwraw microbenchmarks.
+ *
+ * Each benchmark prints one JSON object per line:
+ * {"name": ..., "ops": ..., "ns_per_op": ..., "bytes_per_sec": ...}
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "bench.h"
+
+volatile uintptr_t bench_sink;
+
+uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void bench_report(const char *name, uint64_t ops, uint64_t bytes,
+		  uint64_t elapsed_ns)
+{
+	double secs = elapsed_ns / 1e9;
+
+	printf("{\"name\": \"%s\", \"ops\": %llu, \"ns_per_op\": %.1f, "
+	       "\"bytes_per_sec\": %.0f}\n", name, (unsigned long long) ops,
+	       (double) elapsed_ns / ops, bytes / secs);
+	fflush(stdout);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} benchmarks[] = {
+	{ "hex", bench_hex },
+	{ "validate", bench_validate },
+	{ "cmd_lookup", bench_cmd_lookup },
+	{ "build_msg", bench_build_msg },
+	{ "valid_handler", bench_valid_handler },
+	{ "ascii", bench_ascii },
+	{ "listen", bench_listen },
+};
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+	int j;
+
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+		/* Run all benchmarks or the ones given on the command line */
+		for (j = 1; j < argc; j++) {
+			if (!strcmp(argv[j], benchmarks[i].name))
+				break;
+		}
+		if (argc > 1 && j == argc)
+			continue;
+
+		benchmarks[i].run();
+	}
+
+	return 0;
+}
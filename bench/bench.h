@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Min run time of each benchmark */
+#define BENCH_MIN_NS (200 * 1000 * 1000ULL)
+
+uint64_t bench_now_ns(void);
+void bench_report(const char *name, uint64_t ops, uint64_t bytes,
+		  uint64_t elapsed_ns);
+
+/* Prevent the compiler from optimizing away a result */
+extern volatile uintptr_t bench_sink;
+
+void bench_hex(void);
+void bench_validate(void);
+void bench_cmd_lookup(void);
+void bench_build_msg(void);
+void bench_valid_handler(void);
+void bench_ascii(void);
+void bench_listen(void);
+
+#endif /*_BENCH_H_*/
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * --ascii output encoding: The previous implementation (calloc + one
+ * snprintf per byte) versus hex_encode().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bench.h"
+#include "hex.h"
+
+static const size_t hex_sizes[] = { 64, 1024, 16384 };
+
+/* The --ascii encoder used before hex_encode() */
+static size_t hex_encode_snprintf(const uint8_t *buf, size_t len)
+{
+	size_t i, n = 0;
+	char *ascii_buf;
+
+	ascii_buf = calloc(1, 3 * len + 2);
+	if (!ascii_buf)
+		return 0;
+
+	for (i = 0; i < len; i++)
+		n += snprintf(ascii_buf + n, 3 * len + 2 - n, "%02X ", buf[i]);
+	n += snprintf(ascii_buf + n, 3 * len + 2 - n, "\n");
+
+	bench_sink = (uintptr_t) ascii_buf[n / 2];
+	free(ascii_buf);
+
+	return n;
+}
+
+void bench_hex(void)
+{
+	uint8_t src[16384];
+	char dst[HEX_ENCODED_LEN(sizeof(src))];
+	unsigned int i, s;
+	char name[64];
+
+	for (i = 0; i < sizeof(src); i++)
+		src[i] = rand();
+
+	for (s = 0; s < sizeof(hex_sizes) / sizeof(hex_sizes[0]); s++) {
+		size_t len = hex_sizes[s];
+		uint64_t start, elapsed, ops = 0;
+
+		start = bench_now_ns();
+		do {
+			for (i = 0; i < 64; i++)
+				hex_encode_snprintf(src, len);
+			ops += 64;
+			elapsed = bench_now_ns() - start;
+		} while (elapsed < BENCH_MIN_NS);
+		snprintf(name, sizeof(name), "hex_snprintf_%zu", len);
+		bench_report(name, ops, ops * len, elapsed);
+
+		ops = 0;
+		start = bench_now_ns();
+		do {
+			for (i = 0; i < 64; i++)
+				bench_sink = hex_encode(dst, src, len);
+			ops += 64;
+			elapsed = bench_now_ns() - start;
+		} while (elapsed < BENCH_MIN_NS);
+		snprintf(name, sizeof(name), "hex_encode_%zu", len);
+		bench_report(name, ops, ops * len, elapsed);
+	}
+}
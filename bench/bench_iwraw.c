@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Message handling hot paths and end-to-end listen throughput (against
+ * the mock kernel, see mock.c).
+ *
+ * iwraw.c is included (rather than linked) so that its static functions
+ * and options can be reached.
+ */
+
+#define main iwraw_main
+#include "iwraw.c"
+#undef main
+
+#include "bench.h"
+
+/* Number of events sent by the mock kernel in the listen benchmarks */
+#define BENCH_LISTEN_EVENTS 200000
+/* Size of the frame attribute of the benchmark event */
+#define BENCH_FRAME_LEN 256
+
+static struct nl_msg *event_msg;
+static int null_fd = -1;
+
+/* A new_interface event with a frame attribute (like a typical mlme event) */
+static struct nl_msg *build_event(void)
+{
+	uint8_t frame[BENCH_FRAME_LEN];
+	struct nl_msg *msg;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(frame); i++)
+		frame[i] = i;
+
+	msg = nlmsg_alloc();
+	if (!msg)
+		return NULL;
+
+	genlmsg_put(msg, 0, 0, MOCK_FAMILY_ID_DEFAULT, 0, 0,
+		    NL80211_CMD_NEW_INTERFACE, 0);
+	NLA_PUT_U32(msg, NL80211_ATTR_WIPHY, 0);
+	NLA_PUT_U32(msg, NL80211_ATTR_IFINDEX, 3);
+	NLA_PUT_STRING(msg, NL80211_ATTR_IFNAME, "wlan0");
+	NLA_PUT(msg, NL80211_ATTR_FRAME, sizeof(frame), frame);
+
+	return msg;
+
+nla_put_failure:
+	nlmsg_free(msg);
+	return NULL;
+}
+
+static int bench_setup(void)
+{
+	if (null_fd < 0)
+		null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (!event_msg)
+		event_msg = build_event();
+	if (null_fd < 0 || !event_msg) {
+		fprintf(stderr, "benchmark setup failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static uint8_t *event_attrs(int *len)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(event_msg));
+
+	*len = genlmsg_attrlen(gnlh, 0);
+
+	return (uint8_t *) genlmsg_attrdata(gnlh, 0);
+}
+
+/* Run op until BENCH_MIN_NS has passed and report the result */
+static void bench_run(const char *name, void (*op)(void), size_t bytes)
+{
+	uint64_t start, elapsed, ops = 0;
+	unsigned int i;
+
+	start = bench_now_ns();
+	do {
+		for (i = 0; i < 64; i++)
+			op();
+		ops += 64;
+		elapsed = bench_now_ns() - start;
+	} while (elapsed < BENCH_MIN_NS);
+	bench_report(name, ops, ops * bytes, elapsed);
+}
+
+static void op_validate(void)
+{
+	int len;
+	uint8_t *attrs = event_attrs(&len);
+
+	bench_sink = validate_nla_stream(attrs, len);
+}
+
+void bench_validate(void)
+{
+	int len;
+
+	if (bench_setup())
+		return;
+	(void) event_attrs(&len);
+	bench_run("validate_nla_stream", op_validate, len);
+}
+
+static void op_cmd_lookup(void)
+{
+	/* The first, a middle and the last command of the table */
+	bench_sink = nl80211_cmd_from_str("get_wiphy");
+	bench_sink = nl80211_cmd_from_str("trigger_scan");
+	bench_sink = nl80211_cmd_from_str(command_name(NL80211_CMD_MAX));
+}
+
+void bench_cmd_lookup(void)
+{
+	bench_run("nl80211_cmd_from_str_x3", op_cmd_lookup, 0);
+}
+
+static struct nlcmd build_cmd;
+
+static void op_build_msg(void)
+{
+	struct nl_msg *msg = build_nlcmd_msg(&build_cmd);
+
+	bench_sink = (uintptr_t) msg;
+	nlmsg_free(msg);
+}
+
+void bench_build_msg(void)
+{
+	int len;
+
+	if (bench_setup())
+		return;
+
+	state.nl80211_id = MOCK_FAMILY_ID_DEFAULT;
+	build_cmd.cmd = NL80211_CMD_FRAME;
+	build_cmd.devidx_attr = NL80211_ATTR_IFINDEX;
+	build_cmd.devidx = 3;
+	build_cmd.nla = event_attrs(&len);
+	build_cmd.nla_len = len;
+	bench_run("build_nlcmd_msg", op_build_msg, len);
+}
+
+static void op_valid_handler(void)
+{
+	bench_sink = valid_handler(event_msg, NULL);
+}
+
+static void op_output_write_hex(void)
+{
+	int len;
+	uint8_t *attrs = event_attrs(&len);
+
+	bench_sink = output_write_hex(attrs, len);
+}
+
+/* Output to /dev/null with the default output buffering */
+static void output_setup(bool ascii, bool frames)
+{
+	print_ascii = ascii;
+	framed = frames;
+	(void) output_init(null_fd, OUTPUT_BUF_SIZE_DEFAULT,
+			   OUTPUT_FLUSH_MS_DEFAULT, true);
+}
+
+void bench_valid_handler(void)
+{
+	int len;
+
+	if (bench_setup())
+		return;
+	(void) event_attrs(&len);
+
+	output_setup(false, false);
+	bench_run("valid_handler_raw", op_valid_handler, len);
+	output_setup(false, true);
+	bench_run("valid_handler_framed", op_valid_handler, len);
+	output_setup(true, false);
+	bench_run("valid_handler_ascii", op_valid_handler, len);
+	(void) output_flush();
+}
+
+void bench_ascii(void)
+{
+	int len;
+
+	if (bench_setup())
+		return;
+	(void) event_attrs(&len);
+
+	output_setup(true, false);
+	bench_run("output_write_hex", op_output_write_hex, len);
+	(void) output_flush();
+}
+
+/* Receive BENCH_LISTEN_EVENTS events from the mock kernel */
+static void bench_listen_one(const char *name, bool ascii, bool frames)
+{
+	char path[] = "/tmp/iwraw_bench_XXXXXX";
+	unsigned long prev_rx_count = rx_count;
+	uint64_t start, elapsed;
+	uint8_t *attrs;
+	FILE *f;
+	int fd, len, i;
+
+	fd = mkstemp(path);
+	f = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (!f) {
+		fprintf(stderr, "%s: unable to create mock script\n", name);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	attrs = event_attrs(&len);
+	fprintf(f, "event new_interface %d 0 ", BENCH_LISTEN_EVENTS);
+	for (i = 0; i < len; i++)
+		fprintf(f, "%02x", attrs[i]);
+	fprintf(f, "\n");
+	fclose(f);
+
+	output_setup(ascii, frames);
+	mock_path = path;
+	if (nl80211_init()) {
+		fprintf(stderr, "%s: unable to start the mock kernel\n", name);
+		goto out;
+	}
+
+	start = bench_now_ns();
+	if (!prepare_listen_events())
+		(void) do_listen_events();
+	elapsed = bench_now_ns() - start;
+
+	transport_close(state.nl_sock);
+	nl_socket_free(state.nl_sock);
+
+	if (rx_count - prev_rx_count != BENCH_LISTEN_EVENTS)
+		fprintf(stderr, "%s: %lu of %d events received\n", name,
+			rx_count - prev_rx_count, BENCH_LISTEN_EVENTS);
+	else
+		bench_report(name, BENCH_LISTEN_EVENTS,
+			     (uint64_t) BENCH_LISTEN_EVENTS * len, elapsed);
+out:
+	unlink(path);
+}
+
+void bench_listen(void)
+{
+	if (bench_setup())
+		return;
+
+	bench_listen_one("listen_raw", false, false);
+	bench_listen_one("listen_framed", false, true);
+	bench_listen_one("listen_ascii", true, false);
+	rx_ring_slots = 4096;
+	bench_listen_one("listen_raw_rx_ring", false, false);
+	rx_ring_slots = 0;
+	use_io_uring = true;
+	bench_listen_one("listen_raw_io_uring", false, false);
+	use_io_uring = false;
+}
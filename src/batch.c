@@ -0,0 +1,751 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Batch mode: Read a stream of request records from an input fd,
+ * execute them over the already resolved nl80211 socket and write a
+ * stream of response records to an output fd.
+ *
+ * The request pipeline (struct batch) is shared with the daemon mode,
+ * where the requests come from several clients.
+ *
+ * With events (see batch_set_events()), multicast events received on the
+ * same socket are handed over to the listen mode handlers. Responses to
+ * the event output fd then go through the buffered output as well, so
+ * that records are written in the order the messages were received.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <netlink/msg.h>
+#include <netlink/genl/genl.h>
+#include "iwraw.h"
+#include "record.h"
+#include "log.h"
+
+#define BATCH_RCVBUF_PER_REQ (16 * 1024)
+
+struct batch_slot {
+	uint32_t seq;		/* Request index (of the request source) */
+	uint32_t nlseq;		/* Netlink sequence number */
+	int out_fd;		/* Response fd. -1 if responses are dropped */
+	uint16_t cmd;
+	bool sent;
+	bool done;
+	/* Failed with -ENOENT. Sent again after a family refresh */
+	bool retry;
+	bool retried;
+	struct nl_msg *msg;	/* The request (until it completes) */
+	uint64_t sent_ns;	/* Time the request was sent (monotonic) */
+	int status;
+	/* Records waiting for earlier requests to complete */
+	uint8_t *buf;
+	size_t len;
+	size_t size;
+};
+
+struct batch {
+	unsigned int window;
+	struct batch_slot *slots;
+	struct nl_cb *cb;
+	uint32_t head;		/* Oldest request not yet reported */
+	uint32_t next;		/* Index of the next request */
+	unsigned int inflight;	/* Sent requests not yet completed */
+	bool failed;
+	bool stale;		/* Requests are waiting for a refresh */
+	uint64_t timeout_ns;	/* 0: requests never time out */
+	const struct batch_events *events;
+	/* Writes the responses instead of write_record() and write_full() */
+	int (*write)(int fd, const struct iwraw_rec_hdr *hdr,
+		     const void *data, size_t data_len);
+};
+
+static uint8_t req_buf[BATCH_REQ_MAX_LEN];
+
+ssize_t read_full(int fd, void *buf, size_t len)
+{
+	size_t n = 0;
+
+	while (n < len) {
+		ssize_t read_len;
+
+		read_len = read(fd, (uint8_t *) buf + n, len - n);
+		if (read_len < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (read_len == 0)
+			break; /*EOF*/
+		n += read_len;
+	}
+
+	return n;
+}
+
+/* Write a record to fd (or buffered records, if hdr is NULL) */
+static int batch_write(struct batch *b, int fd,
+		       const struct iwraw_rec_hdr *hdr,
+		       const void *data, size_t data_len)
+{
+	if (b->events && fd == b->events->out_fd)
+		return output_write(hdr, hdr ? sizeof(*hdr) : 0, data,
+				    data_len);
+	if (b->write)
+		return b->write(fd, hdr, data, data_len);
+	if (hdr)
+		return write_record(fd, hdr, data, data_len);
+
+	return write_full(fd, data, data_len);
+}
+
+static struct batch_slot *batch_slot(const struct batch *b, uint32_t idx)
+{
+	return &b->slots[idx % b->window];
+}
+
+/* Find the outstanding request a received message belongs to */
+static struct batch_slot *find_slot(struct batch *b, uint32_t nlseq)
+{
+	uint32_t idx;
+
+	for (idx = b->head; idx != b->next; idx++) {
+		struct batch_slot *slot = batch_slot(b, idx);
+
+		if (slot->sent && !slot->done && slot->nlseq == nlseq)
+			return slot;
+	}
+
+	return NULL;
+}
+
+static void complete_slot(struct batch *b, struct batch_slot *slot,
+			  int status)
+{
+	if (slot->sent) {
+		b->inflight--;
+		stats_latency(STATS_HIST_SEND_ACK,
+			      monotonic_ns() - slot->sent_ns);
+	}
+	stats_request(slot->cmd, status);
+	nlmsg_free(slot->msg);
+	slot->msg = NULL;
+	slot->done = true;
+	slot->status = status;
+	if (status)
+		b->failed = true;
+}
+
+/*
+ * Records of the oldest outstanding request are written directly to
+ * the output. Records of all other requests are kept in the slot until
+ * all earlier requests have been reported.
+ */
+static int slot_append(struct batch *b, struct batch_slot *slot,
+		       const struct iwraw_rec_hdr *hdr, const void *data,
+		       size_t data_len)
+{
+	size_t len = sizeof(*hdr) + data_len;
+
+	if (slot->out_fd < 0)
+		return 0;
+
+	if (slot == batch_slot(b, b->head) && !slot->len)
+		return batch_write(b, slot->out_fd, hdr, data, data_len);
+
+	if (slot->len + len > slot->size) {
+		size_t size = slot->size ? slot->size : 4096;
+		uint8_t *buf;
+
+		while (size < slot->len + len)
+			size *= 2;
+		buf = realloc(slot->buf, size);
+		if (!buf)
+			return -ENOMEM;
+		slot->buf = buf;
+		slot->size = size;
+	}
+
+	memcpy(slot->buf + slot->len, hdr, sizeof(*hdr));
+	if (data_len)
+		memcpy(slot->buf + slot->len + sizeof(*hdr), data, data_len);
+	slot->len += len;
+
+	return 0;
+}
+
+/*
+ * Report all completed requests at the head of the window.
+ * A failing output fd doesn't stop the other requests from being
+ * reported. The last write error is returned.
+ */
+int batch_flush(struct batch *b)
+{
+	int ret = 0;
+
+	while (b->head != b->next) {
+		struct batch_slot *slot = batch_slot(b, b->head);
+		struct iwraw_rec_hdr hdr;
+		int err = 0;
+
+		if (slot->len) {
+			if (slot->out_fd >= 0)
+				err = batch_write(b, slot->out_fd, NULL,
+						  slot->buf, slot->len);
+			slot->len = 0;
+		}
+
+		if (!slot->done) {
+			if (err)
+				ret = err;
+			break;
+		}
+
+		record_init(&hdr, IWRAW_REC_STATUS, NULL, slot->seq);
+		hdr.cmd = slot->cmd;
+		hdr.status = slot->status;
+		if (!err && slot->out_fd >= 0)
+			err = batch_write(b, slot->out_fd, &hdr, NULL, 0);
+		if (err) {
+			int fd = slot->out_fd;
+
+			LOG_ERR_("Failed to write response records (fd %d)\n",
+				 fd);
+			/* The response stream of fd is broken. Drop all
+			 * further responses and make sure the receiver
+			 * (if it is a socket) notices.
+			 */
+			batch_detach_fd(b, fd);
+			(void) shutdown(fd, SHUT_RDWR);
+			ret = err;
+		}
+
+		slot->sent = false;
+		slot->done = false;
+		b->head++;
+	}
+
+	return ret;
+}
+
+/* Drop all responses to out_fd (the receiver is gone) */
+void batch_detach_fd(struct batch *b, int out_fd)
+{
+	uint32_t idx;
+
+	for (idx = b->head; idx != b->next; idx++) {
+		struct batch_slot *slot = batch_slot(b, idx);
+
+		if (slot->out_fd == out_fd) {
+			slot->out_fd = -1;
+			slot->len = 0;
+		}
+	}
+}
+
+/* Number of requests not yet reported to out_fd */
+unsigned int batch_pending(struct batch *b, int out_fd)
+{
+	unsigned int n = 0;
+	uint32_t idx;
+
+	for (idx = b->head; idx != b->next; idx++) {
+		if (batch_slot(b, idx)->out_fd == out_fd)
+			n++;
+	}
+
+	return n;
+}
+
+static int batch_valid_handler(struct nl_msg *msg, void *arg)
+{
+	struct batch *b = arg;
+	struct nlmsghdr *nlh = nlmsg_hdr(msg);
+	struct genlmsghdr *gnlh = nlmsg_data(nlh);
+	struct batch_slot *slot;
+	struct iwraw_rec_hdr hdr;
+
+	/* Events have sequence number 0 */
+	if (b->events && !nlh->nlmsg_seq) {
+		b->events->event(nlh);
+		return NL_SKIP;
+	}
+
+	slot = find_slot(b, nlh->nlmsg_seq);
+	if (!slot) {
+		LOG_WARN_("Unexpected reply (nlseq %u)\n", nlh->nlmsg_seq);
+		return NL_SKIP;
+	}
+
+	LOG_DBG_("%s: seq %u\n", __func__, slot->seq);
+	stats_rx(nlh);
+	record_init(&hdr, IWRAW_REC_REPLY, nlh, slot->seq);
+	if (slot_append(b, slot, &hdr, genlmsg_attrdata(gnlh, 0),
+			hdr.len - sizeof(hdr)))
+		LOG_ERR_("Failed to write reply record %u\n", slot->seq);
+	else
+		stats_written(gnlh->cmd, hdr.len);
+
+	return NL_SKIP;
+}
+
+static int batch_error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err,
+			       void *arg)
+{
+	struct batch *b = arg;
+	struct batch_slot *slot;
+
+	(void) nla;
+	slot = find_slot(b, err->msg.nlmsg_seq);
+	if (!slot)
+		return NL_SKIP;
+
+	/* The family id may be stale (--cache). The refresh can't be done
+	 * from within the receive callbacks, see batch_retry().
+	 */
+	if (err->error == -ENOENT && !slot->retried) {
+		slot->sent = false;
+		slot->retry = true;
+		b->inflight--;
+		b->stale = true;
+		return NL_SKIP;
+	}
+	complete_slot(b, slot, err->error);
+
+	return NL_SKIP;
+}
+
+static int batch_ack_handler(struct nl_msg *msg, void *arg)
+{
+	struct batch *b = arg;
+	struct batch_slot *slot;
+
+	slot = find_slot(b, nlmsg_hdr(msg)->nlmsg_seq);
+	if (slot)
+		complete_slot(b, slot, 0);
+
+	return NL_SKIP;
+}
+
+/*
+ * Hand over multicast events received on the socket to events
+ * (and join the output of responses to events->out_fd with the events)
+ */
+void batch_set_events(struct batch *b, const struct batch_events *events)
+{
+	b->events = events;
+}
+
+/* The oldest request still waiting for its response, if any */
+static struct batch_slot *oldest_sent(const struct batch *b)
+{
+	uint32_t idx;
+
+	for (idx = b->head; idx != b->next; idx++) {
+		struct batch_slot *slot = batch_slot(b, idx);
+
+		if (slot->sent && !slot->done)
+			return slot;
+	}
+
+	return NULL;
+}
+
+/*
+ * Time (in ms) until the oldest request in flight times out, or -1.
+ * Requests are sent in order, so no other request times out earlier.
+ */
+int batch_timeout(const struct batch *b)
+{
+	struct batch_slot *slot;
+	uint64_t now, deadline;
+
+	if (!b->timeout_ns)
+		return -1;
+
+	slot = oldest_sent(b);
+	if (!slot)
+		return -1;
+
+	now = monotonic_ns();
+	deadline = slot->sent_ns + b->timeout_ns;
+	if (now >= deadline)
+		return 0;
+
+	return (deadline - now + 999999) / 1000000;
+}
+
+/*
+ * Fail the requests that have timed out. Their late responses (if any)
+ * are dropped, so the socket can still be used for other requests.
+ */
+void batch_expire(struct batch *b)
+{
+	struct batch_slot *slot;
+
+	while (!batch_timeout(b)) {
+		slot = oldest_sent(b);
+		LOG_WARN_("Request %u (%s) timed out\n", slot->seq,
+			  command_name(slot->cmd));
+		complete_slot(b, slot, -ETIMEDOUT);
+	}
+}
+
+/*
+ * Write the responses with write (hdr is NULL for a buffer of complete
+ * records). write returns 0 or a negative error.
+ */
+void batch_set_writer(struct batch *b,
+		      int (*write)(int fd, const struct iwraw_rec_hdr *hdr,
+				   const void *data, size_t data_len))
+{
+	b->write = write;
+}
+
+/* Returns true if any request has failed */
+bool batch_failed(const struct batch *b)
+{
+	return b->failed;
+}
+
+bool batch_full(const struct batch *b)
+{
+	return b->next - b->head >= b->window;
+}
+
+unsigned int batch_inflight(const struct batch *b)
+{
+	return b->inflight;
+}
+
+/* Send the request of slot (again) */
+static void batch_send(struct batch *b, struct batch_slot *slot)
+{
+	int err;
+
+	nlmsg_hdr(slot->msg)->nlmsg_seq = NL_AUTO_SEQ;
+	slot->sent_ns = monotonic_ns();
+	err = transport_send(state.nl_sock, slot->msg);
+	if (err < 0) {
+		LOG_ERR_("Request %u: send failed: %s\n", slot->seq,
+			 nl_geterror(err));
+		complete_slot(b, slot, -EIO);
+	} else {
+		slot->nlseq = nlmsg_hdr(slot->msg)->nlmsg_seq;
+		slot->sent = true;
+		b->inflight++;
+	}
+}
+
+/*
+ * Requests that failed with -ENOENT are sent again (once) if the family
+ * id turns out to have changed, just like in send command mode. The
+ * family is only refreshed once, but requests still in flight with the
+ * old id are retried as well.
+ */
+static void batch_retry(struct batch *b)
+{
+	uint32_t idx;
+
+	b->stale = false;
+	(void) nl80211_refresh_busy();
+
+	for (idx = b->head; idx != b->next; idx++) {
+		struct batch_slot *slot = batch_slot(b, idx);
+		struct nlmsghdr *nlh;
+
+		if (!slot->retry)
+			continue;
+		slot->retry = false;
+		slot->retried = true;
+		nlh = nlmsg_hdr(slot->msg);
+		if (nlh->nlmsg_type == state.nl80211_id) {
+			complete_slot(b, slot, -ENOENT);
+			continue;
+		}
+		nlh->nlmsg_type = state.nl80211_id;
+		batch_send(b, slot);
+	}
+}
+
+/*
+ * Send a request to the kernel (without waiting for the response).
+ * nla points to the nla stream following the request header.
+ * The response records will be written to out_fd with the request
+ * index seq. The caller must make sure the window isn't full.
+ */
+void batch_submit(struct batch *b, const struct iwraw_req_hdr *hdr,
+		  void *nla, const struct nlcmd *defaults, int out_fd,
+		  uint32_t seq)
+{
+	struct batch_slot *slot = batch_slot(b, b->next++);
+	struct nlcmd c = *defaults;
+
+	slot->seq = seq;
+	slot->out_fd = out_fd;
+	slot->cmd = hdr->cmd;
+	slot->sent = false;
+	slot->done = false;
+	slot->retry = false;
+	slot->retried = false;
+
+	if (hdr->cmd <= NL80211_CMD_UNSPEC || hdr->cmd > NL80211_CMD_MAX) {
+		LOG_ERR_("Request %u: unsupported nl command: %u\n",
+			 seq, hdr->cmd);
+		complete_slot(b, slot, -EINVAL);
+		return;
+	}
+
+	c.cmd = hdr->cmd;
+	c.nla = nla;
+	c.nla_len = hdr->len - sizeof(*hdr);
+	if (c.nla_len && validate_nla_stream(c.nla, c.nla_len)) {
+		complete_slot(b, slot, -EINVAL);
+		return;
+	}
+
+	if (hdr->flags & IWRAW_REQ_F_WIPHY) {
+		c.devidx_attr = NL80211_ATTR_WIPHY;
+		c.devidx = hdr->devidx;
+	} else if (hdr->flags & IWRAW_REQ_F_IFINDEX) {
+		c.devidx_attr = NL80211_ATTR_IFINDEX;
+		c.devidx = hdr->devidx;
+	}
+
+	slot->msg = build_nlcmd_msg(&c);
+	if (!slot->msg) {
+		complete_slot(b, slot, -ENOMEM);
+		return;
+	}
+
+	batch_send(b, slot);
+}
+
+/*
+ * Receive and dispatch the next message(s) from the kernel.
+ * Returns the number of received messages.
+ */
+int batch_recv(struct batch *b)
+{
+	int err;
+
+	err = nl_recvmsgs_report(state.nl_sock, b->cb);
+	if (b->stale)
+		batch_retry(b);
+	/* The rest of a multipart response hasn't arrived yet (--timeout) */
+	if (err == -NLE_AGAIN)
+		return 0;
+	/* libnl reports ENOBUFS as NLE_NOMEM */
+	if (err == -NLE_NOMEM)
+		sockbuf_overrun(state.nl_sock);
+	/* Overruns are expected when listening for events. The requests
+	 * in flight may have lost their responses, though.
+	 */
+	if (err == -NLE_NOMEM && b->events) {
+		if (b->inflight)
+			LOG_WARN_("Responses may have been lost (%u requests in flight)\n",
+				  b->inflight);
+		b->events->overrun();
+		return 0;
+	}
+	if (err < 0) {
+		LOG_ERR_("nl_recvmsgs failed: %d\n", err);
+		return -EIO;
+	}
+
+	return err;
+}
+
+struct batch *batch_alloc(unsigned int window, unsigned int timeout_ms)
+{
+	struct batch *b;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return NULL;
+
+	b->window = window;
+	b->timeout_ns = timeout_ms * 1000000ULL;
+	b->slots = calloc(window, sizeof(*b->slots));
+	b->cb = nl_cb_alloc((log_level > LOG_WARNING) ?
+			    NL_CB_DEBUG : NL_CB_DEFAULT);
+	if (!b->slots || !b->cb) {
+		batch_free(b);
+		return NULL;
+	}
+
+	/* Replies to all outstanding requests must fit in the socket buffer */
+	if (window > 1)
+		(void) sockbuf_grow_rcvbuf(state.nl_sock,
+					   window * BATCH_RCVBUF_PER_REQ);
+
+	nlrecv_setup(b->cb);
+	/* Sequence numbers are checked by the batch handlers */
+	nl_cb_set(b->cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, no_seq_check, NULL);
+	nl_cb_err(b->cb, NL_CB_CUSTOM, batch_error_handler, b);
+	nl_cb_set(b->cb, NL_CB_FINISH, NL_CB_CUSTOM, batch_ack_handler, b);
+	nl_cb_set(b->cb, NL_CB_ACK, NL_CB_CUSTOM, batch_ack_handler, b);
+	nl_cb_set(b->cb, NL_CB_VALID, NL_CB_CUSTOM, batch_valid_handler, b);
+
+	return b;
+}
+
+void batch_free(struct batch *b)
+{
+	unsigned int i;
+
+	if (b->slots) {
+		for (i = 0; i < b->window; i++) {
+			free(b->slots[i].buf);
+			nlmsg_free(b->slots[i].msg);
+		}
+		free(b->slots);
+	}
+	nl_cb_put(b->cb);
+	free(b);
+}
+
+/* Read one request. Returns 1 if a request was read and 0 on EOF */
+static int read_request(int fd, struct iwraw_req_hdr *hdr, uint32_t seq)
+{
+	size_t nla_len;
+	ssize_t n;
+
+	n = read_full(fd, hdr, sizeof(*hdr));
+	if (n < 0)
+		return n;
+	if (n == 0)
+		return 0; /*EOF*/
+	if (n < (ssize_t) sizeof(*hdr)) {
+		LOG_ERR_("Truncated request header (%zd bytes)\n", n);
+		return -EINVAL;
+	}
+
+	if (hdr->len < sizeof(*hdr) ||
+	    hdr->len - sizeof(*hdr) > sizeof(req_buf)) {
+		LOG_ERR_("Request %u: invalid length %u\n", seq, hdr->len);
+		return -EINVAL;
+	}
+
+	nla_len = hdr->len - sizeof(*hdr);
+	n = read_full(fd, req_buf, nla_len);
+	if (n < 0)
+		return n;
+	if (n < (ssize_t) nla_len) {
+		LOG_ERR_("Request %u: truncated payload\n", seq);
+		return -EINVAL;
+	}
+
+	return 1;
+}
+
+/*
+ * Execute all requests read from in_fd. defaults holds the device index
+ * given on the command line (if any). It is used for all requests that
+ * don't have a device index of their own.
+ * Up to window requests are sent to the kernel before waiting for the
+ * responses. Replies are matched with their requests using the netlink
+ * sequence number, and reported in the same order as the requests were
+ * read.
+ *
+ * Returns 0 if all requests succeeded, 1 if one or more requests failed
+ * and a negative error code if the request stream is malformed.
+ */
+int do_batch(int in_fd, int out_fd, const struct nlcmd *defaults,
+	     unsigned int window, unsigned int timeout_ms)
+{
+	struct batch *b;
+	uint32_t seq = 0;
+	bool eof = false;
+	int ret = 0;
+
+	b = batch_alloc(window, timeout_ms);
+	if (!b) {
+		LOG_ERR_("failed to allocate batch context\n");
+		return -ENOMEM;
+	}
+
+	for (;;) {
+		struct iwraw_req_hdr hdr;
+		struct pollfd pfd;
+		int err, timeout;
+
+		stats_poll();
+		while (!eof && !batch_full(b)) {
+			err = read_request(in_fd, &hdr, seq);
+			if (err <= 0) {
+				/* Complete outstanding requests before
+				 * reporting a malformed stream
+				 */
+				eof = true;
+				ret = err;
+				break;
+			}
+			batch_submit(b, &hdr, req_buf, defaults, out_fd, seq++);
+		}
+
+		err = batch_flush(b);
+		if (err) {
+			ret = err;
+			goto out;
+		}
+
+		if (!batch_inflight(b)) {
+			if (eof)
+				break;
+			continue;
+		}
+
+		/* Don't wait for a response longer than until the oldest
+		 * request times out
+		 */
+		timeout = batch_timeout(b);
+		if (timeout >= 0) {
+			pfd.fd = transport_fd(state.nl_sock);
+			pfd.events = POLLIN;
+			err = poll(&pfd, 1, timeout);
+			if (err < 0 && errno != EINTR) {
+				ret = -errno;
+				goto out;
+			}
+			if (err <= 0) {
+				batch_expire(b);
+				continue;
+			}
+		}
+
+		err = batch_recv(b);
+		if (err < 0) {
+			ret = err;
+			goto out;
+		}
+	}
+
+	LOG_NOTICE_("Executed %u requests\n", seq);
+
+	if (!ret && b->failed)
+		ret = 1;
+ out:
+	batch_free(b);
+	return ret;
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * On-disk cache of generic netlink family info (family id and multicast
+ * group ids).
+ *
+ * The ids are assigned by the kernel when the family is registered, so
+ * the cache is only valid for the boot (and the cfg80211 module load) it
+ * was written in. The cache is keyed by the boot id and the ctime of
+ * the module's sysfs directory, which can both be checked without
+ * talking to the kernel over netlink. sysfs may report a new ctime even
+ * if the module wasn't reloaded, which only causes a cache refresh.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "iwraw.h"
+#include "log.h"
+
+#define FAMILY_CACHE_MAGIC 0x69776663 /* "iwfc" */
+#define FAMILY_CACHE_VERSION 1
+#define BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+#define BOOT_ID_LEN 36
+#define MODULE_PATH "/sys/module/cfg80211"
+
+struct family_cache_key {
+	char boot_id[BOOT_ID_LEN + 1];
+	uint64_t module_time;
+};
+
+struct family_cache {
+	uint32_t magic;
+	uint32_t version;
+	struct family_cache_key key;
+	char family[GENL_NAMSIZ];
+	struct genl_family_info info;
+};
+
+static int family_cache_key(struct family_cache_key *key)
+{
+	struct stat st;
+	ssize_t n;
+	int fd;
+
+	memset(key, 0, sizeof(*key));
+
+	fd = open(BOOT_ID_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	n = read_full(fd, key->boot_id, BOOT_ID_LEN);
+	close(fd);
+	if (n != BOOT_ID_LEN)
+		return -EIO;
+
+	/* Missing if cfg80211 is not loaded (the cache is useless then
+	 * anyway).
+	 */
+	if (stat(MODULE_PATH, &st))
+		return -errno;
+	key->module_time = (uint64_t) st.st_ctim.tv_sec * 1000000000ULL +
+			   st.st_ctim.tv_nsec;
+
+	return 0;
+}
+
+/*
+ * Read the info of family from the cache file path.
+ * Returns 0 on a cache hit and a negative value if the cache is missing
+ * or not valid.
+ */
+int family_cache_load(const char *path, const char *family,
+		      struct genl_family_info *info)
+{
+	struct family_cache cache;
+	struct family_cache_key key;
+	ssize_t n;
+	int fd, ret;
+
+	ret = family_cache_key(&key);
+	if (ret)
+		return ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	n = read_full(fd, &cache, sizeof(cache));
+	close(fd);
+
+	if (n != sizeof(cache) ||
+	    cache.magic != FAMILY_CACHE_MAGIC ||
+	    cache.version != FAMILY_CACHE_VERSION ||
+	    memcmp(&cache.key, &key, sizeof(key)) ||
+	    strncmp(cache.family, family, sizeof(cache.family)) ||
+	    cache.info.id <= 0 ||
+	    cache.info.n_grps < 0 || cache.info.n_grps > GENL_MCGRP_MAX) {
+		LOG_INFO_("Family cache %s is stale\n", path);
+		return -ESTALE;
+	}
+
+	*info = cache.info;
+	LOG_INFO_("Read %s family info from %s\n", family, path);
+
+	return 0;
+}
+
+/* Write the info of family to the cache file path */
+int family_cache_store(const char *path, const char *family,
+		       const struct genl_family_info *info)
+{
+	char tmp_path[PATH_MAX];
+	struct family_cache cache;
+	int fd, ret;
+
+	memset(&cache, 0, sizeof(cache));
+	ret = family_cache_key(&cache.key);
+	if (ret)
+		return ret;
+	cache.magic = FAMILY_CACHE_MAGIC;
+	cache.version = FAMILY_CACHE_VERSION;
+	strncpy(cache.family, family, sizeof(cache.family) - 1);
+	cache.info = *info;
+
+	/* Replace the file atomically, so that concurrent readers never
+	 * see a partially written cache.
+	 */
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path) >=
+	    (int) sizeof(tmp_path))
+		return -ENAMETOOLONG;
+
+	/* A new file with an unpredictable name (never a planted symlink) */
+	fd = mkstemp(tmp_path);
+	if (fd < 0)
+		return -errno;
+	ret = fchmod(fd, 0644) ? -errno : 0;
+	if (!ret)
+		ret = write_full(fd, &cache, sizeof(cache));
+	close(fd);
+
+	if (!ret && rename(tmp_path, path))
+		ret = -errno;
+	if (ret)
+		(void) unlink(tmp_path);
+
+	return ret;
+}
@@ -0,0 +1,567 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Daemon mode (iwrawd): Serve batch requests from local clients over a
+ * Unix domain socket.
+ *
+ * Each client connection carries a stream of request records and gets
+ * a stream of response records back, exactly like in batch mode.
+ * The requests of all clients are executed over the same nl80211 socket
+ * and share the same in-flight window.
+ *
+ * The same poll loop can also serve requests from stdin (a client that
+ * writes its responses to stdout) and listen for events on the nl80211
+ * socket (--events), so that one process can both send commands and see
+ * the events they cause. Timers (output flush and statistics) are
+ * handled by the poll timeout.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "iwraw.h"
+#include "log.h"
+
+#define DAEMON_MAX_CLIENTS 64
+#define DAEMON_CLIENT_BUF_LEN (sizeof(struct iwraw_req_hdr) + BATCH_REQ_MAX_LEN)
+/* A client with more unread responses than this is dropped */
+#define DAEMON_CLIENT_OUTQ_MAX (4 * 1024 * 1024)
+
+struct client {
+	int fd;			/* Requests are read from fd */
+	int out_fd;		/* Responses are written to out_fd */
+	bool local;		/* stdin/stdout (not closed) */
+	bool eof;
+	uint32_t seq;		/* Index of the next request */
+	uint8_t *buf;		/* Partially received requests */
+	size_t len;
+	/* Responses not yet accepted by the socket (written on POLLOUT) */
+	uint8_t *out;
+	size_t out_len;
+	size_t out_size;
+	bool overflow;		/* The queue overflowed (client dropped) */
+};
+
+static struct client clients[DAEMON_MAX_CLIENTS];
+static volatile sig_atomic_t daemon_stop;
+
+static void daemon_signal_handler(int sig)
+{
+	(void) sig;
+	daemon_stop = 1;
+}
+
+static int daemon_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t mask;
+	int fd, ret;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		LOG_ERR_("Socket path too long: %s\n", path);
+		return -ENAMETOOLONG;
+	}
+	strcpy(addr.sun_path, path);
+
+	/* Only replace a stale socket (of an earlier daemon) */
+	if (!lstat(path, &st)) {
+		if (!S_ISSOCK(st.st_mode)) {
+			LOG_ERR_("%s exists and is not a socket\n", path);
+			return -EEXIST;
+		}
+		(void) unlink(path);
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	/* Requests are executed with our privileges, so only our own user
+	 * may connect
+	 */
+	mask = umask(0077);
+	ret = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+	umask(mask);
+	if (ret || listen(fd, DAEMON_MAX_CLIENTS)) {
+		int err = -errno;
+
+		LOG_ERR_("Unable to listen on %s: %s\n", path, strerror(-err));
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
+static struct client *add_client(int fd, int out_fd, bool local)
+{
+	struct client *c = NULL;
+	int i;
+
+	for (i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+		if (clients[i].fd < 0) {
+			c = &clients[i];
+			break;
+		}
+	}
+
+	if (!c) {
+		LOG_WARN_("Too many clients. Dropping connection\n");
+		return NULL;
+	}
+
+	c->buf = malloc(DAEMON_CLIENT_BUF_LEN);
+	if (!c->buf)
+		return NULL;
+
+	c->fd = fd;
+	c->out_fd = out_fd;
+	c->local = local;
+	c->eof = false;
+	c->seq = 0;
+	c->len = 0;
+	c->out_len = 0;
+	c->overflow = false;
+
+	return c;
+}
+
+static void accept_client(int listen_fd)
+{
+	struct ucred cred = { .uid = (uid_t) -1 };
+	socklen_t len = sizeof(cred);
+	int fd;
+
+	/* Non blocking, so that a client that doesn't read its responses
+	 * can't stall the other clients
+	 */
+	fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0) {
+		LOG_WARN_("accept failed: %s\n", strerror(errno));
+		return;
+	}
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) ||
+	    (cred.uid != 0 && cred.uid != geteuid())) {
+		LOG_WARN_("Rejecting client of another user (uid %u)\n",
+			  cred.uid);
+		close(fd);
+		return;
+	}
+
+	if (!add_client(fd, fd, false)) {
+		close(fd);
+		return;
+	}
+
+	LOG_INFO_("Client connected (fd %d)\n", fd);
+}
+
+static void close_client(struct batch *b, struct client *c)
+{
+	LOG_INFO_("Client disconnected (fd %d)\n", c->fd);
+	batch_detach_fd(b, c->out_fd);
+	if (!c->local)
+		close(c->fd);
+	free(c->buf);
+	c->buf = NULL;
+	free(c->out);
+	c->out = NULL;
+	c->out_size = 0;
+	c->fd = -1;
+}
+
+static struct client *find_client(int out_fd)
+{
+	int i;
+
+	for (i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0 && clients[i].out_fd == out_fd)
+			return &clients[i];
+	}
+
+	return NULL;
+}
+
+static int client_queue(struct client *c, const void *data, size_t len)
+{
+	if (c->overflow || c->out_len + len > DAEMON_CLIENT_OUTQ_MAX) {
+		if (!c->overflow)
+			LOG_WARN_("Client fd %d: too many unread responses\n",
+				  c->fd);
+		c->overflow = true;
+		return -ENOBUFS;
+	}
+
+	if (c->out_len + len > c->out_size) {
+		size_t size = c->out_size ? c->out_size : 4096;
+		uint8_t *out;
+
+		while (size < c->out_len + len)
+			size *= 2;
+		out = realloc(c->out, size);
+		if (!out)
+			return -ENOMEM;
+		c->out = out;
+		c->out_size = size;
+	}
+
+	memcpy(c->out + c->out_len, data, len);
+	c->out_len += len;
+
+	return 0;
+}
+
+/*
+ * Response writer of the batch (see batch_set_writer()). Whatever the
+ * socket doesn't accept right away is queued and written on POLLOUT.
+ */
+static int client_write(int fd, const struct iwraw_rec_hdr *hdr,
+			const void *data, size_t data_len)
+{
+	struct client *c = find_client(fd);
+	struct msghdr msg;
+	struct iovec iov[2];
+	ssize_t n = 0;
+	int i, iovcnt = 0, ret;
+
+	/* stdout (like in batch mode) */
+	if (!c || c->local) {
+		if (hdr)
+			return write_record(fd, hdr, data, data_len);
+		return write_full(fd, data, data_len);
+	}
+
+	if (hdr) {
+		iov[iovcnt].iov_base = (void *) hdr;
+		iov[iovcnt++].iov_len = sizeof(*hdr);
+	}
+	if (data_len) {
+		iov[iovcnt].iov_base = (void *) data;
+		iov[iovcnt++].iov_len = data_len;
+	}
+
+	/* Keep the order of the responses */
+	if (!c->out_len) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		n = sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				return -errno;
+			n = 0;
+		}
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		if ((size_t) n >= iov[i].iov_len) {
+			n -= iov[i].iov_len;
+			continue;
+		}
+		ret = client_queue(c, (uint8_t *) iov[i].iov_base + n,
+				   iov[i].iov_len - n);
+		if (ret)
+			return ret;
+		n = 0;
+	}
+
+	return 0;
+}
+
+/* Write queued responses */
+static int client_drain(struct client *c)
+{
+	ssize_t n;
+
+	n = send(c->fd, c->out, c->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -errno;
+
+	memmove(c->out, c->out + n, c->out_len - n);
+	c->out_len -= n;
+
+	return 0;
+}
+
+/*
+ * Submit all complete requests received from the client (as long as
+ * there is room in the window).
+ * Returns a negative value if the request stream is malformed.
+ */
+static int client_submit(struct batch *b, struct client *c,
+			 const struct nlcmd *defaults)
+{
+	size_t off = 0;
+	int ret = 0;
+
+	while (!batch_full(b) && c->len - off >= sizeof(struct iwraw_req_hdr)) {
+		struct iwraw_req_hdr hdr;
+
+		memcpy(&hdr, c->buf + off, sizeof(hdr));
+		if (hdr.len < sizeof(hdr) || hdr.len > DAEMON_CLIENT_BUF_LEN) {
+			LOG_ERR_("Client fd %d: invalid request length %u\n",
+				 c->fd, hdr.len);
+			ret = -EINVAL;
+			break;
+		}
+		if (c->len - off < hdr.len)
+			break;
+
+		batch_submit(b, &hdr, c->buf + off + sizeof(hdr), defaults,
+			     c->out_fd, c->seq++);
+		off += hdr.len;
+	}
+
+	if (off) {
+		memmove(c->buf, c->buf + off, c->len - off);
+		c->len -= off;
+	}
+
+	return ret;
+}
+
+static bool client_has_request(const struct client *c)
+{
+	struct iwraw_req_hdr hdr;
+
+	if (c->len < sizeof(hdr))
+		return false;
+	memcpy(&hdr, c->buf, sizeof(hdr));
+
+	return c->len >= hdr.len;
+}
+
+static int client_read(struct client *c)
+{
+	ssize_t n;
+
+	/* stdin may not be a socket. It is only read when poll() says so */
+	if (c->local)
+		n = read(c->fd, c->buf + c->len, DAEMON_CLIENT_BUF_LEN - c->len);
+	else
+		n = recv(c->fd, c->buf + c->len,
+			 DAEMON_CLIENT_BUF_LEN - c->len, MSG_DONTWAIT);
+	if (n < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -errno;
+	if (n == 0) {
+		c->eof = true;
+		return 0;
+	}
+	c->len += n;
+
+	return 0;
+}
+
+/*
+ * Serve requests on the Unix domain socket path (if given) until SIGINT
+ * or SIGTERM is received. If in_fd is given, requests are read from
+ * in_fd as well, and the responses are written to out_fd. Without path
+ * and events, the loop ends when all requests from in_fd have been
+ * served. If events is given, events are received and handed over to
+ * events as well.
+ *
+ * Returns 1 if requests from in_fd (without path) failed, like
+ * do_batch().
+ */
+int do_daemon(const char *path, int in_fd, int out_fd,
+	      const struct batch_events *events, const struct nlcmd *defaults,
+	      unsigned int window, unsigned int timeout_ms)
+{
+	struct pollfd fds[DAEMON_MAX_CLIENTS + 2];
+	struct sigaction sa;
+	struct client *local = NULL;
+	struct batch *b;
+	int listen_fd = -1, i, ret = 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_signal_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < DAEMON_MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	b = batch_alloc(window, timeout_ms);
+	if (!b) {
+		LOG_ERR_("failed to allocate batch context\n");
+		return -ENOMEM;
+	}
+	if (events)
+		batch_set_events(b, events);
+	batch_set_writer(b, client_write);
+
+	if (path) {
+		listen_fd = daemon_listen(path);
+		if (listen_fd < 0) {
+			batch_free(b);
+			return listen_fd;
+		}
+		LOG_NOTICE_("Listening for requests on %s\n", path);
+	}
+
+	if (in_fd >= 0) {
+		local = add_client(in_fd, out_fd, true);
+		if (!local) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	while (!daemon_stop) {
+		int timeout, batch_ms;
+
+		stats_poll();
+		flight_poll();
+		fds[0].fd = (events || batch_inflight(b)) ?
+			    transport_fd(state.nl_sock) : -1;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		fds[1].fd = listen_fd;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+		for (i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+			struct client *c = &clients[i];
+			/* Don't read more requests until there is room
+			 * in the window
+			 */
+			bool rd = c->fd >= 0 && !c->eof &&
+				  c->len < DAEMON_CLIENT_BUF_LEN &&
+				  !batch_full(b);
+			bool wr = c->fd >= 0 && c->out_len;
+
+			fds[i + 2].fd = (rd || wr) ? c->fd : -1;
+			fds[i + 2].events = (rd ? POLLIN : 0) |
+					    (wr ? POLLOUT : 0);
+			fds[i + 2].revents = 0;
+		}
+
+		timeout = events ? events->idle() : stats_timeout();
+		batch_ms = batch_timeout(b);
+		if (batch_ms >= 0 && (timeout < 0 || batch_ms < timeout))
+			timeout = batch_ms;
+		if (poll(fds, DAEMON_MAX_CLIENTS + 2, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			ret = batch_recv(b);
+			if (ret < 0)
+				break;
+			/* Only the mock kernel ever hangs up */
+			if (!ret && (fds[0].revents & POLLHUP))
+				break;
+			ret = 0;
+			/* Make room in the window for requests already
+			 * buffered (their clients may not be polled again)
+			 */
+			(void) batch_flush(b);
+		}
+		batch_expire(b);
+
+		if (fds[1].revents & POLLIN)
+			accept_client(listen_fd);
+
+		for (i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+			struct client *c = &clients[i];
+
+			if (c->fd < 0)
+				continue;
+
+			if ((fds[i + 2].revents & (POLLOUT | POLLERR | POLLHUP)) &&
+			    c->out_len && client_drain(c)) {
+				close_client(b, c);
+				continue;
+			}
+
+			if ((fds[i + 2].events & POLLIN) &&
+			    (fds[i + 2].revents & (POLLIN | POLLERR | POLLHUP)) &&
+			    client_read(c)) {
+				close_client(b, c);
+				continue;
+			}
+
+			if (client_submit(b, c, defaults)) {
+				/* Like a malformed stream in batch mode */
+				if (c == local)
+					ret = -EINVAL;
+				close_client(b, c);
+				continue;
+			}
+		}
+		if (ret)
+			break;
+
+		(void) batch_flush(b);
+
+		/* Keep half closed clients until all their responses
+		 * have been delivered
+		 */
+		for (i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+			struct client *c = &clients[i];
+
+			if (c->fd >= 0 && c->eof && !client_has_request(c) &&
+			    !batch_pending(b, c->out_fd) && !c->out_len) {
+				/* Only a partial request can be left */
+				if (c->len)
+					LOG_WARN_("Client fd %d: truncated request\n",
+						  c->fd);
+				close_client(b, c);
+			}
+		}
+
+		/* Without a socket, stop when stdin has been served. Events
+		 * are received until SIGINT or SIGTERM, like in listen mode
+		 */
+		if (!path && !events && (!local || local->fd < 0))
+			break;
+	}
+
+	if (!path && !ret && batch_failed(b))
+		ret = 1;
+
+out:
+	for (i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0)
+			close_client(b, &clients[i]);
+	}
+	if (path) {
+		close(listen_fd);
+		(void) unlink(path);
+	}
+	batch_free(b);
+
+	return ret;
+}
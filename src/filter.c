@@ -0,0 +1,398 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Event filters.
+ *
+ * A filter expression is a comma separated list of conditions that must
+ * all be true for an event to match:
+ *
+ *   cmd=<name|id>, ifindex=<n>, if=<name>, wiphy=<n>, vendor=<id>[:<subcmd>],
+ *   subcmd=<n>
+ *
+ * Each expression is compiled into a rule in a flat table. An event is
+ * accepted if it matches any of the rules.
+ *
+ * The rules can also be compiled into a classic BPF socket filter, so
+ * that the kernel drops uninteresting events before they are queued on
+ * the socket.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+#include <netlink/msg.h>
+#include <netlink/attr.h>
+#include <netlink/genl/genl.h>
+#include "iwraw.h"
+#include "log.h"
+
+/* Max number of BPF instructions per rule (cmd + 4 attributes + ret) */
+#define FILTER_BPF_RULE_LEN (1 + 1 + 4 * 7 + 1)
+#define FILTER_BPF_MAX_LEN (6 + FILTER_MAX_RULES * FILTER_BPF_RULE_LEN + 1)
+/* Offset of the attributes in a generic netlink message */
+#define FILTER_ATTR_OFFSET (NLMSG_HDRLEN + GENL_HDRLEN)
+#define FILTER_ACCEPT 0xffffffff
+
+static struct filter_rule rules[FILTER_MAX_RULES];
+static unsigned int n_rules;
+/* Attributes needed by any of the rules */
+static uint32_t attr_mask;
+
+static int parse_u32(const char *str, uint32_t *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtoul(str, &end, 0);
+	if (errno || end == str || *end)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int parse_cond(struct filter_rule *rule, char *cond)
+{
+	char *val = strchr(cond, '=');
+	char *subcmd;
+
+	if (!val)
+		return -EINVAL;
+	*val++ = '\0';
+
+	if (!strcmp(cond, "cmd")) {
+		if (parse_u32(val, &rule->cmd)) {
+			rule->cmd = nl80211_cmd_from_str(val);
+			if (rule->cmd == NL80211_CMD_UNSPEC)
+				return -EINVAL;
+		}
+		rule->mask |= FILTER_CMD;
+	} else if (!strcmp(cond, "ifindex")) {
+		if (parse_u32(val, &rule->ifindex))
+			return -EINVAL;
+		rule->mask |= FILTER_IFINDEX;
+	} else if (!strcmp(cond, "if")) {
+		rule->ifindex = if_nametoindex(val);
+		if (!rule->ifindex)
+			return -ENODEV;
+		rule->mask |= FILTER_IFINDEX;
+	} else if (!strcmp(cond, "wiphy")) {
+		if (parse_u32(val, &rule->wiphy))
+			return -EINVAL;
+		rule->mask |= FILTER_WIPHY;
+	} else if (!strcmp(cond, "vendor")) {
+		subcmd = strchr(val, ':');
+		if (subcmd) {
+			*subcmd++ = '\0';
+			if (parse_u32(subcmd, &rule->subcmd))
+				return -EINVAL;
+			rule->mask |= FILTER_SUBCMD;
+		}
+		if (parse_u32(val, &rule->vendor_id))
+			return -EINVAL;
+		rule->mask |= FILTER_VENDOR_ID;
+	} else if (!strcmp(cond, "subcmd")) {
+		if (parse_u32(val, &rule->subcmd))
+			return -EINVAL;
+		rule->mask |= FILTER_SUBCMD;
+	} else {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Compile a filter expression into rule */
+int filter_rule_parse(const char *expr, struct filter_rule *rule)
+{
+	char *str, *cond, *saveptr;
+	int ret = 0;
+
+	str = strdup(expr);
+	if (!str)
+		return -ENOMEM;
+
+	memset(rule, 0, sizeof(*rule));
+	for (cond = strtok_r(str, ",", &saveptr); cond;
+	     cond = strtok_r(NULL, ",", &saveptr)) {
+		ret = parse_cond(rule, cond);
+		if (ret)
+			break;
+	}
+	free(str);
+
+	if (ret || !rule->mask) {
+		LOG_ERR_("Invalid filter: %s\n", expr);
+		return ret ? ret : -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Compile a filter expression and add it to the rule table */
+int filter_add(const char *expr)
+{
+	struct filter_rule rule;
+	int ret;
+
+	if (n_rules == FILTER_MAX_RULES) {
+		LOG_ERR_("Too many filters (max %d)\n", FILTER_MAX_RULES);
+		return -ENOSPC;
+	}
+
+	ret = filter_rule_parse(expr, &rule);
+	if (ret)
+		return ret;
+
+	rules[n_rules++] = rule;
+	attr_mask |= rule.mask & ~FILTER_CMD;
+
+	return 0;
+}
+
+bool filter_active(void)
+{
+	return n_rules > 0;
+}
+
+const struct filter_rule *filter_rules(unsigned int *n)
+{
+	*n = n_rules;
+	return rules;
+}
+
+/*
+ * Extract the attributes in need (FILTER_* mask) from a message.
+ * The attributes are stored in a filter_rule (mask holds the attributes
+ * found).
+ */
+static void filter_parse(const struct nlmsghdr *nlh, struct filter_rule *msg,
+			 uint32_t need)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlh);
+	struct nlattr *attr;
+	int rem;
+
+	msg->cmd = gnlh->cmd;
+	msg->mask = FILTER_CMD;
+	need &= ~FILTER_CMD;
+	if (!need)
+		return;
+
+	nla_for_each_attr(attr, genlmsg_attrdata(gnlh, 0),
+			  genlmsg_attrlen(gnlh, 0), rem) {
+		uint32_t *val;
+		uint32_t bit;
+
+		switch (nla_type(attr)) {
+		case NL80211_ATTR_IFINDEX:
+			bit = FILTER_IFINDEX;
+			val = &msg->ifindex;
+			break;
+		case NL80211_ATTR_WIPHY:
+			bit = FILTER_WIPHY;
+			val = &msg->wiphy;
+			break;
+		case NL80211_ATTR_VENDOR_ID:
+			bit = FILTER_VENDOR_ID;
+			val = &msg->vendor_id;
+			break;
+		case NL80211_ATTR_VENDOR_SUBCMD:
+			bit = FILTER_SUBCMD;
+			val = &msg->subcmd;
+			break;
+		default:
+			continue;
+		}
+
+		if (nla_len(attr) < (int) sizeof(uint32_t))
+			continue;
+
+		*val = nla_get_u32(attr);
+		msg->mask |= bit;
+		/* Stop as soon as all needed attributes are found */
+		if ((msg->mask & need) == need)
+			break;
+	}
+}
+
+static bool rule_match(const struct filter_rule *rule,
+		       const struct filter_rule *msg)
+{
+	if ((msg->mask & rule->mask) != rule->mask)
+		return false;
+	if ((rule->mask & FILTER_CMD) && rule->cmd != msg->cmd)
+		return false;
+	if ((rule->mask & FILTER_IFINDEX) && rule->ifindex != msg->ifindex)
+		return false;
+	if ((rule->mask & FILTER_WIPHY) && rule->wiphy != msg->wiphy)
+		return false;
+	if ((rule->mask & FILTER_VENDOR_ID) &&
+	    rule->vendor_id != msg->vendor_id)
+		return false;
+	if ((rule->mask & FILTER_SUBCMD) && rule->subcmd != msg->subcmd)
+		return false;
+
+	return true;
+}
+
+/* Returns true if the message matches any of the rules */
+bool filter_match(const struct nlmsghdr *nlh)
+{
+	struct filter_rule msg;
+	unsigned int i;
+
+	if (!n_rules)
+		return true;
+
+	filter_parse(nlh, &msg, attr_mask);
+	for (i = 0; i < n_rules; i++) {
+		if (rule_match(&rules[i], &msg))
+			return true;
+	}
+
+	return false;
+}
+
+/* Returns true if the message matches rule (see filter_rule_parse()) */
+bool filter_rule_match(const struct filter_rule *rule,
+		       const struct nlmsghdr *nlh)
+{
+	struct filter_rule msg;
+
+	filter_parse(nlh, &msg, rule->mask);
+
+	return rule_match(rule, &msg);
+}
+
+#define BPF_STMT_(code, k) \
+	((struct sock_filter) BPF_STMT((code), (k)))
+#define BPF_JUMP_(code, k, jt, jf) \
+	((struct sock_filter) BPF_JUMP((code), (k), (jt), (jf)))
+
+/*
+ * Emit code checking that the u32 attribute type has the value val.
+ * The indexes of the jumps taken (jf) on mismatch are stored in fail.
+ * BPF loads are big endian, so the value is compared in network byte
+ * order.
+ */
+static unsigned int bpf_attr_check(struct sock_filter *insn, unsigned int n,
+				   uint16_t type, uint32_t val,
+				   unsigned int *fail, unsigned int *n_fail)
+{
+	insn[n++] = BPF_STMT_(BPF_LD | BPF_IMM, FILTER_ATTR_OFFSET);
+	insn[n++] = BPF_STMT_(BPF_LDX | BPF_IMM, type);
+	/* A = offset of the attribute (0 if not found) */
+	insn[n++] = BPF_STMT_(BPF_LD | BPF_W | BPF_ABS,
+			      SKF_AD_OFF + SKF_AD_NLATTR);
+	fail[(*n_fail)++] = n;
+	insn[n++] = BPF_JUMP_(BPF_JMP | BPF_JGT | BPF_K, 0, 0, 0);
+	insn[n++] = BPF_STMT_(BPF_MISC | BPF_TAX, 0);
+	insn[n++] = BPF_STMT_(BPF_LD | BPF_W | BPF_IND, NLA_HDRLEN);
+	fail[(*n_fail)++] = n;
+	insn[n++] = BPF_JUMP_(BPF_JMP | BPF_JEQ | BPF_K, htonl(val), 0, 0);
+
+	return n;
+}
+
+/*
+ * Compile the rules into a BPF program.
+ * Messages that are not nl80211 events (controller messages, ACKs and
+ * replies to our own requests) are always accepted.
+ * Returns the number of instructions.
+ */
+static unsigned int filter_compile(struct sock_filter *insn, int nl80211_id)
+{
+	unsigned int i, j, n = 0;
+
+	/* nlmsg_type */
+	insn[n++] = BPF_STMT_(BPF_LD | BPF_H | BPF_ABS,
+			      offsetof(struct nlmsghdr, nlmsg_type));
+	insn[n++] = BPF_JUMP_(BPF_JMP | BPF_JEQ | BPF_K, htons(nl80211_id),
+			      1, 0);
+	insn[n++] = BPF_STMT_(BPF_RET | BPF_K, FILTER_ACCEPT);
+	/* Events have sequence number 0 */
+	insn[n++] = BPF_STMT_(BPF_LD | BPF_W | BPF_ABS,
+			      offsetof(struct nlmsghdr, nlmsg_seq));
+	insn[n++] = BPF_JUMP_(BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 0);
+	insn[n++] = BPF_STMT_(BPF_RET | BPF_K, FILTER_ACCEPT);
+
+	for (i = 0; i < n_rules; i++) {
+		const struct filter_rule *rule = &rules[i];
+		unsigned int fail[5 * 2], n_fail = 0;
+
+		if (rule->mask & FILTER_CMD) {
+			insn[n++] = BPF_STMT_(BPF_LD | BPF_B | BPF_ABS,
+					      NLMSG_HDRLEN);
+			fail[n_fail++] = n;
+			insn[n++] = BPF_JUMP_(BPF_JMP | BPF_JEQ | BPF_K,
+					      rule->cmd, 0, 0);
+		}
+		if (rule->mask & FILTER_IFINDEX)
+			n = bpf_attr_check(insn, n, NL80211_ATTR_IFINDEX,
+					   rule->ifindex, fail, &n_fail);
+		if (rule->mask & FILTER_WIPHY)
+			n = bpf_attr_check(insn, n, NL80211_ATTR_WIPHY,
+					   rule->wiphy, fail, &n_fail);
+		if (rule->mask & FILTER_VENDOR_ID)
+			n = bpf_attr_check(insn, n, NL80211_ATTR_VENDOR_ID,
+					   rule->vendor_id, fail, &n_fail);
+		if (rule->mask & FILTER_SUBCMD)
+			n = bpf_attr_check(insn, n, NL80211_ATTR_VENDOR_SUBCMD,
+					   rule->subcmd, fail, &n_fail);
+		insn[n++] = BPF_STMT_(BPF_RET | BPF_K, FILTER_ACCEPT);
+
+		/* Make the failed checks jump to the next rule */
+		for (j = 0; j < n_fail; j++)
+			insn[fail[j]].jf = n - fail[j] - 1;
+	}
+
+	insn[n++] = BPF_STMT_(BPF_RET | BPF_K, 0);
+
+	return n;
+}
+
+/*
+ * Attach the rules as a socket filter on the netlink socket fd.
+ * Returns 0 if there are no rules.
+ */
+int filter_attach(int fd, int nl80211_id)
+{
+	static struct sock_filter insn[FILTER_BPF_MAX_LEN];
+	struct sock_fprog prog;
+
+	if (!n_rules)
+		return 0;
+
+	prog.len = filter_compile(insn, nl80211_id);
+	prog.filter = insn;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+		       sizeof(prog)) < 0)
+		return -errno;
+
+	LOG_INFO_("Attached socket filter (%u instructions)\n", prog.len);
+
+	return 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Flight recorder.
+ *
+ * The last received messages are kept in memory and written to a pcap
+ * file (see pcap.c) on SIGUSR2 or when a trigger event is received.
+ *
+ * Everything is allocated up front: the messages are copied into a byte
+ * ring and described by a ring of entries. When either ring is full, the
+ * oldest messages are dropped. Recording a message costs one memcpy().
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/netlink.h>
+#include "iwraw.h"
+#include "log.h"
+
+/* Min time between two triggered dumps */
+#define FLIGHT_TRIGGER_HOLDOFF_NS 1000000000ULL
+
+struct flight_entry {
+	uint64_t ts;		/* Receive time (written to the dump) */
+	uint64_t mono;		/* Receive time (monotonic_ns()) */
+	uint32_t off;
+	uint32_t len;
+};
+
+struct flight {
+	const char *path;
+	uint64_t window_ns;
+	/* Entry ring: entries[head] is the oldest message */
+	struct flight_entry *entries;
+	unsigned int max;
+	unsigned int head;
+	unsigned int count;
+	/* Byte ring */
+	uint8_t *buf;
+	uint32_t size;
+	uint32_t wr;
+	bool trigger_set;
+	struct filter_rule trigger;
+	uint64_t last_trigger_ns;	/* monotonic_ns() */
+	unsigned int n_dumps;
+};
+
+static struct flight *fr;
+static volatile sig_atomic_t dump_requested;
+
+static void flight_signal_handler(int sig)
+{
+	(void) sig;
+	dump_requested = 1;
+}
+
+/*
+ * Set up the flight recorder for (at most) max messages and size bytes of
+ * messages. Dumps are written to files named path.<time>.<n> and only
+ * hold the messages of the last window_s seconds (0 means no limit).
+ * A dump is also written when a message matching the filter expression
+ * trigger (if given) is received.
+ */
+int flight_init(unsigned int max, size_t size, unsigned int window_s,
+		const char *path, const char *trigger)
+{
+	struct sigaction sa;
+	int ret;
+
+	if (size > UINT32_MAX)
+		return -EINVAL;
+
+	fr = calloc(1, sizeof(*fr));
+	if (!fr)
+		return -ENOMEM;
+
+	if (trigger) {
+		ret = filter_rule_parse(trigger, &fr->trigger);
+		if (ret)
+			goto err;
+		fr->trigger_set = true;
+	}
+
+	ret = -ENOMEM;
+	fr->entries = calloc(max, sizeof(*fr->entries));
+	fr->buf = malloc(size);
+	if (!fr->entries || !fr->buf)
+		goto err;
+
+	fr->max = max;
+	fr->size = size;
+	fr->path = path;
+	fr->window_ns = window_s * 1000000000ULL;
+
+	/* No SA_RESTART, so that the dump is written without waiting for
+	 * the next message (see stats_init())
+	 */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = flight_signal_handler;
+	sigaction(SIGUSR2, &sa, NULL);
+
+	return 0;
+
+err:
+	free(fr->entries);
+	free(fr->buf);
+	free(fr);
+	fr = NULL;
+
+	return ret;
+}
+
+static void flight_drop_oldest(void)
+{
+	fr->head = (fr->head + 1) % fr->max;
+	fr->count--;
+}
+
+/* Make room for len bytes and return their offset in the byte ring */
+static uint32_t flight_alloc(uint32_t len)
+{
+	uint32_t oldest;
+
+	for (;;) {
+		if (fr->count == fr->max) {
+			flight_drop_oldest();
+			continue;
+		}
+		if (!fr->count)
+			return 0;
+
+		oldest = fr->entries[fr->head].off;
+		if (fr->wr > oldest) {
+			/* Free: [wr, size) and [0, oldest) */
+			if (fr->size - fr->wr >= len)
+				return fr->wr;
+			if (oldest >= len)
+				return 0;
+		} else if (oldest - fr->wr >= len) {
+			/* Free: [wr, oldest) */
+			return fr->wr;
+		}
+
+		flight_drop_oldest();
+	}
+}
+
+/*
+ * Record the message nlh received at ts_ns (ns since the epoch) and
+ * mono_ns (monotonic_ns()). The dump window and the trigger holdoff are
+ * based on the latter, so that they aren't affected by clock steps.
+ */
+void flight_record(const struct nlmsghdr *nlh, uint64_t ts_ns,
+		   uint64_t mono_ns)
+{
+	struct flight_entry *e;
+	uint32_t len;
+
+	if (!fr)
+		return;
+
+	/* Keep the messages aligned */
+	len = NLMSG_ALIGN(nlh->nlmsg_len);
+	if (len > fr->size)
+		return;
+
+	e = &fr->entries[(fr->head + fr->count) % fr->max];
+	e->off = flight_alloc(len);
+	e->len = nlh->nlmsg_len;
+	e->ts = ts_ns;
+	e->mono = mono_ns;
+	memcpy(fr->buf + e->off, nlh, nlh->nlmsg_len);
+	fr->wr = e->off + len;
+	fr->count++;
+
+	if (fr->trigger_set && filter_rule_match(&fr->trigger, nlh) &&
+	    mono_ns - fr->last_trigger_ns >= FLIGHT_TRIGGER_HOLDOFF_NS) {
+		fr->last_trigger_ns = mono_ns;
+		LOG_NOTICE_("Flight recorder triggered\n");
+		(void) flight_dump();
+	}
+}
+
+/* Write the recorded messages to a new file */
+int flight_dump(void)
+{
+	char path[PATH_MAX];
+	uint64_t first_mono = 0;
+	struct pcap *p;
+	unsigned int i, n = 0;
+	int ret = 0;
+
+	if (!fr)
+		return 0;
+
+	snprintf(path, sizeof(path), "%s.%llu.%u", fr->path,
+		 (unsigned long long) (timestamp_ns() / 1000000000ULL),
+		 fr->n_dumps++);
+	p = pcap_open(path, 0, 0);
+	if (!p)
+		return -EIO;
+
+	if (fr->count && fr->window_ns) {
+		const struct flight_entry *newest =
+			&fr->entries[(fr->head + fr->count - 1) % fr->max];
+
+		if (newest->mono > fr->window_ns)
+			first_mono = newest->mono - fr->window_ns;
+	}
+
+	for (i = 0; i < fr->count && !ret; i++) {
+		const struct flight_entry *e =
+			&fr->entries[(fr->head + i) % fr->max];
+
+		if (e->mono < first_mono)
+			continue;
+		ret = pcap_write(p, (struct nlmsghdr *) (fr->buf + e->off),
+				 e->ts);
+		n++;
+	}
+	pcap_close(p);
+
+	if (ret)
+		LOG_ERR_("Unable to write flight recorder dump %s\n", path);
+	else
+		LOG_NOTICE_("Wrote %u messages to %s\n", n, path);
+
+	return ret;
+}
+
+/* Write a dump if requested (SIGUSR2) */
+void flight_poll(void)
+{
+	if (!dump_requested)
+		return;
+
+	dump_requested = 0;
+	(void) flight_dump();
+}
@@ -3,12 +3,44 @@
  */
 
 #include <asm/errno.h>
+#include <errno.h>
 #include <netlink/genl/genl.h>
 #include <netlink/genl/family.h>
 #include <netlink/genl/ctrl.h>
 #include <netlink/msg.h>
 #include <netlink/attr.h>
 #include <linux/genetlink.h>
+#include <poll.h>
+#include <string.h>
+#include "iwraw.h"
+
+/*
+ * Wait until the socket is readable or the time deadline_ns (monotonic_ns())
+ * has passed (0 means no deadline). Returns -ETIMEDOUT when it has.
+ */
+static int wait_readable(struct nl_sock *sock, uint64_t deadline_ns)
+{
+	struct pollfd pfd = {
+		.fd = transport_fd(sock),
+		.events = POLLIN,
+	};
+	uint64_t now;
+	int ret, timeout = -1;
+
+	for (;;) {
+		if (deadline_ns) {
+			now = monotonic_ns();
+			if (now >= deadline_ns)
+				return -ETIMEDOUT;
+			timeout = (deadline_ns - now + 999999) / 1000000;
+		}
+		ret = poll(&pfd, 1, timeout);
+		if (ret > 0)
+			return 0;
+		if (ret < 0 && errno != EINTR)
+			return -errno;
+	}
+}
 
 static int error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err,
 			 void *arg)
@@ -29,14 +61,9 @@ static int ack_handler(struct nl_msg *msg, void *arg)
 	return NL_STOP;
 }
 
-struct handler_args {
-	const char *group;
-	int id;
-};
-
 static int family_handler(struct nl_msg *msg, void *arg)
 {
-	struct handler_args *grp = arg;
+	struct genl_family_info *info = arg;
 	struct nlattr *tb[CTRL_ATTR_MAX + 1];
 	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
 	struct nlattr *mcgrp;
@@ -45,11 +72,15 @@ static int family_handler(struct nl_msg *msg, void *arg)
 	nla_parse(tb, CTRL_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
 		  genlmsg_attrlen(gnlh, 0), NULL);
 
+	if (tb[CTRL_ATTR_FAMILY_ID])
+		info->id = nla_get_u16(tb[CTRL_ATTR_FAMILY_ID]);
+
 	if (!tb[CTRL_ATTR_MCAST_GROUPS])
 		return NL_SKIP;
 
 	nla_for_each_nested(mcgrp, tb[CTRL_ATTR_MCAST_GROUPS], rem_mcgrp) {
 		struct nlattr *tb_mcgrp[CTRL_ATTR_MCAST_GRP_MAX + 1];
+		struct genl_mcgrp *grp;
 
 		nla_parse(tb_mcgrp, CTRL_ATTR_MCAST_GRP_MAX,
 			  nla_data(mcgrp), nla_len(mcgrp), NULL);
@@ -57,25 +88,34 @@ static int family_handler(struct nl_msg *msg, void *arg)
 		if (!tb_mcgrp[CTRL_ATTR_MCAST_GRP_NAME] ||
 		    !tb_mcgrp[CTRL_ATTR_MCAST_GRP_ID])
 			continue;
-		if (strncmp(nla_data(tb_mcgrp[CTRL_ATTR_MCAST_GRP_NAME]),
-			    grp->group, nla_len(tb_mcgrp[CTRL_ATTR_MCAST_GRP_NAME])))
-			continue;
+		if (info->n_grps == GENL_MCGRP_MAX)
+			break;
+
+		grp = &info->grps[info->n_grps++];
+		nla_strlcpy(grp->name, tb_mcgrp[CTRL_ATTR_MCAST_GRP_NAME],
+			    sizeof(grp->name));
 		grp->id = nla_get_u32(tb_mcgrp[CTRL_ATTR_MCAST_GRP_ID]);
-		break;
 	}
 
 	return NL_SKIP;
 }
 
-int nl_get_multicast_id(struct nl_sock *sock, const char *family, const char *group)
+/*
+ * Get the id and the multicast groups of a generic netlink family.
+ * Everything is resolved with a single CTRL_CMD_GETFAMILY request (the
+ * id of the controller itself is fixed). With a timeout_ms other than 0,
+ * -ETIMEDOUT is returned if there is no reply within timeout_ms.
+ */
+int nl_get_family(struct nl_sock *sock, const char *family,
+		  struct genl_family_info *info, unsigned int timeout_ms)
 {
+	uint64_t deadline_ns = 0;
 	struct nl_msg *msg;
 	struct nl_cb *cb;
-	int ret, ctrlid;
-	struct handler_args grp = {
-		.group = group,
-		.id = -ENOENT,
-	};
+	int ret;
+
+	memset(info, 0, sizeof(*info));
+	info->id = -ENOENT;
 
 	msg = nlmsg_alloc();
 	if (!msg)
@@ -87,29 +127,44 @@ int nl_get_multicast_id(struct nl_sock *sock, const char *family, const char *gr
 		goto out_fail_cb;
 	}
 
-	ctrlid = genl_ctrl_resolve(sock, "nlctrl");
-
-	genlmsg_put(msg, 0, 0, ctrlid, 0,
+	genlmsg_put(msg, 0, 0, GENL_ID_CTRL, 0,
 		    0, CTRL_CMD_GETFAMILY, 0);
 
 	ret = -ENOBUFS;
 	NLA_PUT_STRING(msg, CTRL_ATTR_FAMILY_NAME, family);
 
-	ret = nl_send_auto_complete(sock, msg);
+	ret = transport_send(sock, msg);
 	if (ret < 0)
 		goto out;
 
 	ret = 1;
 
+	nlrecv_setup(cb);
 	nl_cb_err(cb, NL_CB_CUSTOM, error_handler, &ret);
 	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, ack_handler, &ret);
-	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, family_handler, &grp);
-
-	while (ret > 0)
-		nl_recvmsgs(sock, cb);
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, family_handler, info);
+
+	if (timeout_ms)
+		deadline_ns = monotonic_ns() + timeout_ms * 1000000ULL;
+
+	/* The socket may be non blocking (e.g. with --timeout), so it is
+	 * only read when it is readable
+	 */
+	while (ret > 0) {
+		int err = wait_readable(sock, deadline_ns);
+
+		if (err) {
+			ret = err;
+			break;
+		}
+		err = nl_recvmsgs(sock, cb);
+		/* Errors reported by the callbacks have already set ret */
+		if (err < 0 && err != -NLE_AGAIN && ret > 0)
+			ret = -EIO;
+	}
 
-	if (ret == 0)
-		ret = grp.id;
+	if (ret == 0 && info->id < 0)
+		ret = info->id;
  nla_put_failure:
  out:
 	nl_cb_put(cb);
@@ -117,3 +172,16 @@ int nl_get_multicast_id(struct nl_sock *sock, const char *family, const char *gr
 	nlmsg_free(msg);
 	return ret;
 }
+
+/* Id of a multicast group of a family (see nl_get_family()) */
+int nl_family_group_id(const struct genl_family_info *info, const char *group)
+{
+	int i;
+
+	for (i = 0; i < info->n_grps; i++) {
+		if (!strcmp(info->grps[i].name, group))
+			return info->grps[i].id;
+	}
+
+	return -ENOENT;
+}
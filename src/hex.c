@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "hex.h"
+
+/* "XX " for each byte value, padded to 4 bytes */
+static uint32_t hex_table[256];
+static bool hex_table_ready;
+
+static void hex_table_init(void)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		char s[4] = { digits[i >> 4], digits[i & 0xf], ' ', '\0' };
+
+		memcpy(&hex_table[i], s, sizeof(s));
+	}
+	hex_table_ready = true;
+}
+
+/*
+ * Encode len bytes from src as "XX XX ... XX \n" (same format as
+ * printf("%02X ") for each byte followed by a newline).
+ * dst must have room for HEX_ENCODED_LEN(len) bytes.
+ * Returns the number of bytes written.
+ */
+size_t hex_encode(char *dst, const uint8_t *src, size_t len)
+{
+	char *p = dst;
+	size_t i;
+
+	if (!hex_table_ready)
+		hex_table_init();
+
+	/* Each entry is stored with one 4 byte write. The 4th (pad) byte
+	 * is overwritten by the next entry (or the newline).
+	 */
+	for (i = 0; i < len; i++) {
+		memcpy(p, &hex_table[src[i]], sizeof(uint32_t));
+		p += 3;
+	}
+	*p++ = '\n';
+
+	return p - dst;
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _HEX_H_
+#define _HEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of the hex encoding of len bytes (including the newline) */
+#define HEX_ENCODED_LEN(len) (3 * (len) + 1)
+
+size_t hex_encode(char *dst, const uint8_t *src, size_t len);
+
+#endif /*_HEX_H_*/
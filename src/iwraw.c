@@ -20,11 +20,13 @@
 
 #include <stdbool.h>
 #include <getopt.h>
-
+#include <stdlib.h>
 #include <poll.h>
+#include <time.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <net/if.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -38,29 +40,55 @@
 #include <netlink/genl/genl.h>
 #include <netlink/genl/family.h>
 #include <netlink/genl/ctrl.h>
-#include "nl80211.h"
+#include "iwraw.h"
 #include "log.h"
 #include <iwraw_config.h>
 
 #define NLA_INPUT_STREAM_MAX_LEN (1024)
 
-int nl_get_multicast_id(struct nl_sock *sock, const char *family,
-			const char *group);
-
-enum nl80211_commands nl80211_cmd_from_str(const char *str);
-void print_nl80211_cmds(void);
-
-struct nl80211_state {
-	struct nl_sock *nl_sock;
-	int nl80211_id;
-};
-
 int log_level = LOG_WARNING;
 bool log_stderr = true, log_initialized;
 
-static bool print_ascii, dev_by_phy, devidx_set, cmd_set;
+struct nl80211_state state;
+/* nl80211 family id and multicast groups */
+static struct genl_family_info nl80211_info;
+
+static bool print_ascii, dev_by_phy, devidx_set, cmd_set, batch_mode, framed;
 static uint32_t devidx;
-static struct nl80211_state state;
+static unsigned int batch_window = 1;
+static const char *daemon_path;
+static const char *listen_groups;
+static const char *cache_path;
+static const char *mock_path;
+static const char *pcap_path;
+static const char *replay_path;
+static double replay_speed = 1.0;
+static uint64_t pcap_rotate_size;
+static unsigned int pcap_rotate_time;
+/* --write-pcap capture */
+static struct pcap *capture;
+static unsigned int flight_max;
+static size_t flight_size = FLIGHT_SIZE_DEFAULT;
+static unsigned int flight_window;
+static const char *flight_path = FLIGHT_PATH_DEFAULT;
+static const char *flight_trigger;
+static unsigned int rx_ring_slots;
+static bool use_io_uring;
+static bool listen_events;
+static unsigned int request_timeout_ms;
+/* nl80211_info was read from the cache (and may be stale) */
+static bool nl80211_info_cached;
+static uint32_t rec_seq;
+static unsigned long rx_count;
+static size_t output_buf_size = OUTPUT_BUF_SIZE_DEFAULT;
+static unsigned int output_flush_ms = OUTPUT_FLUSH_MS_DEFAULT;
+static bool output_flush_idle = true;
+static unsigned int send_repeat = 1;
+static double send_rate;
+static const char *stats_path;
+static unsigned int stats_interval = STATS_INTERVAL_DEFAULT;
+static int rcvbuf = SOCKBUF_RCVBUF_DEFAULT;
+static int sndbuf = SOCKBUF_SNDBUF_DEFAULT;
 static uint8_t nla_input_stream[NLA_INPUT_STREAM_MAX_LEN];
 static enum nl80211_commands cur_cmd;
 
@@ -74,46 +102,107 @@ static int nl80211_init(void)
 		return -ENOMEM;
 	}
 
-	nl_socket_set_buffer_size(state.nl_sock, 8192, 8192);
+	if (mock_path || replay_path) {
+		err = mock_setup(mock_path, replay_path, replay_speed);
+		if (err)
+			goto out_handle_destroy;
+		/* The ids of the mock kernel are not worth caching */
+		cache_path = NULL;
+	}
 
-	if (genl_connect(state.nl_sock)) {
+	if (transport_connect(state.nl_sock)) {
 		LOG_ERR_("Failed to connect to generic netlink.\n");
 		err = -ENOLINK;
 		goto out_handle_destroy;
 	}
 
-	state.nl80211_id = genl_ctrl_resolve(state.nl_sock, "nl80211");
-	if (state.nl80211_id < 0) {
-		LOG_ERR_("nl80211 not found.\n");
-		err = -ENOENT;
-		goto out_handle_destroy;
+	/* The socket must be connected before the buffers can be set */
+	err = sockbuf_init(state.nl_sock, rcvbuf, sndbuf);
+	if (err)
+		goto out_transport_close;
+
+	nl80211_info_cached = cache_path &&
+		!family_cache_load(cache_path, "nl80211", &nl80211_info);
+	if (!nl80211_info_cached) {
+		err = nl_get_family(state.nl_sock, "nl80211", &nl80211_info,
+				    request_timeout_ms);
+		if (err == -ETIMEDOUT) {
+			LOG_ERR_("No reply from the genl controller within %u ms\n",
+				 request_timeout_ms);
+			goto out_transport_close;
+		} else if (err) {
+			LOG_ERR_("nl80211 not found.\n");
+			err = -ENOENT;
+			goto out_transport_close;
+		}
+		if (cache_path &&
+		    family_cache_store(cache_path, "nl80211", &nl80211_info))
+			LOG_WARN_("Unable to write family cache %s\n",
+				  cache_path);
 	}
+	state.nl80211_id = nl80211_info.id;
 
 	return 0;
 
+out_transport_close:
+	transport_close(state.nl_sock);
 out_handle_destroy:
 	nl_socket_free(state.nl_sock);
 
 	return err;
 }
 
-static int write_ascii(int fd, const uint8_t *buf, int len)
+/*
+ * Resolve the nl80211 family again (over sk) if the family info was read
+ * from the cache. Called after a failure that may have been caused by
+ * stale ids. Returns true if the ids have changed.
+ */
+static bool nl80211_refresh(struct nl_sock *sk)
 {
-	int i, n = 0;
-	char *ascii_buf;
+	struct genl_family_info info;
 
-	ascii_buf = calloc(1, 3 * len + 2);
-	if (!ascii_buf)
-		return -ENOMEM;
+	if (!nl80211_info_cached)
+		return false;
+	nl80211_info_cached = false;
 
-	for (i = 0; i < len; i++)
-		n += snprintf(ascii_buf + n, 3 * len + 2 - n, "%02X ", buf[i]);
-	n += snprintf(ascii_buf + n, 3 * len + 2 - n, "\n");
+	if (nl_get_family(sk, "nl80211", &info,
+			  request_timeout_ms))
+		return false;
+	if (!memcmp(&info, &nl80211_info, sizeof(info)))
+		return false;
 
-	(void) write(fd, ascii_buf, n);
-	free(ascii_buf);
+	LOG_NOTICE_("Family cache %s was stale. Refreshing\n", cache_path);
+	nl80211_info = info;
+	state.nl80211_id = info.id;
+	if (family_cache_store(cache_path, "nl80211", &nl80211_info))
+		LOG_WARN_("Unable to write family cache %s\n", cache_path);
 
-	return NL_OK;
+	return true;
+}
+
+/*
+ * nl80211_refresh() for batch and daemon mode, where the socket is busy
+ * with other requests (and events). The family is resolved over a socket
+ * of its own.
+ */
+bool nl80211_refresh_busy(void)
+{
+	struct nl_sock *sk;
+	bool changed = false;
+
+	if (!nl80211_info_cached)
+		return false;
+
+	sk = nl_socket_alloc();
+	if (!sk)
+		return false;
+	if (!transport_connect(sk)) {
+		changed = nl80211_refresh(sk);
+		transport_close(sk);
+	}
+	nl_socket_free(sk);
+
+	return changed;
 }
 
 static int error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err,
@@ -139,6 +228,14 @@ static int finish_handler(struct nl_msg *msg, void *arg)
 	return NL_SKIP;
 }
 
+/* Only replies to the request just sent (late replies may follow a timeout) */
+static int seq_check(struct nl_msg *msg, void *arg)
+{
+	uint32_t *seq = arg;
+
+	return nlmsg_hdr(msg)->nlmsg_seq == *seq ? NL_OK : NL_SKIP;
+}
+
 static int ack_handler(struct nl_msg *msg, void *arg)
 {
 	int *ret = arg;
@@ -150,23 +247,80 @@ static int ack_handler(struct nl_msg *msg, void *arg)
 	return NL_STOP;
 }
 
-static int valid_handler(struct nl_msg *msg, void *arg)
+/* Filter and write a received message */
+static void handle_message(const struct nlmsghdr *nlh)
 {
-	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct genlmsghdr *gnlh = nlmsg_data(nlh);
 	struct nlattr *head_attr = genlmsg_attrdata(gnlh, 0);
 	int attr_len = genlmsg_attrlen(gnlh, 0);
 
+	int ret;
+
+	rx_count++;
+	stats_rx(nlh);
+	if (!cmd_set)
+		flight_record(nlh, nlrecv_timestamp(), nlrecv_monotonic());
+	if (!cmd_set && !filter_match(nlh)) {
+		stats_filtered(gnlh->cmd);
+		return;
+	}
+
+	if (capture) {
+		/* The complete message is captured */
+		attr_len = nlh->nlmsg_len;
+		ret = pcap_write(capture, nlh, nlrecv_timestamp());
+	} else if (framed) {
+		struct iwraw_rec_hdr hdr;
+
+		record_init(&hdr, cmd_set ? IWRAW_REC_REPLY : IWRAW_REC_EVENT,
+			    nlh, rec_seq++);
+		ret = output_write(&hdr, sizeof(hdr), head_attr, attr_len);
+		if (ret)
+			LOG_ERR_("Failed to write record\n");
+	} else if (print_ascii) {
+		ret = output_write_hex((uint8_t *) head_attr, attr_len);
+		if (ret)
+			LOG_ERR_("Failed to write output\n");
+	} else {
+		ret = output_write(NULL, 0, head_attr, attr_len);
+		if (ret)
+			LOG_ERR_("Failed to write output\n");
+	}
+
+	if (!ret) {
+		stats_written(gnlh->cmd, attr_len);
+		stats_latency(STATS_HIST_RECV_WRITE,
+			      monotonic_ns() - nlrecv_monotonic());
+	}
+}
+
+static int valid_handler(struct nl_msg *msg, void *arg)
+{
 	LOG_DBG_("%s\n", __func__);
 	(void) arg;
-	if (print_ascii)
-		return write_ascii(1, (uint8_t *) head_attr, attr_len);
-
-	(void) write(1, (uint8_t *) head_attr, attr_len);
+	handle_message(nlmsg_hdr(msg));
 
 	return NL_OK;
 }
 
-static int no_seq_check(struct nl_msg *msg, void *arg)
+/*
+ * Tell the consumer of the framed output that events have been lost
+ * (overruns is the total number of overruns so far)
+ */
+static void write_gap_record(unsigned long overruns)
+{
+	struct iwraw_rec_hdr hdr;
+	struct iwraw_rec_gap gap;
+
+	record_init(&hdr, IWRAW_REC_GAP, NULL, rec_seq++);
+	hdr.len += sizeof(gap);
+	hdr.status = -ENOBUFS;
+	gap.overruns = overruns;
+	if (output_write(&hdr, sizeof(hdr), &gap, sizeof(gap)))
+		LOG_ERR_("Failed to write record\n");
+}
+
+int no_seq_check(struct nl_msg *msg, void *arg)
 {
 	(void) msg;
 	(void) arg;
@@ -174,46 +328,89 @@ static int no_seq_check(struct nl_msg *msg, void *arg)
 	return NL_OK;
 }
 
-static int prepare_listen_events(void)
-{
-	int mcid, ret;
+/* Groups joined if --groups is not given */
+static const char * const default_groups[] = {
+	"config", "scan", "regulatory", "mlme", "vendor",
+};
 
-	/* Configuration multicast group */
-	mcid = nl_get_multicast_id(state.nl_sock, "nl80211", "config");
-	if (mcid < 0)
-		return mcid;
+static int join_group(const char *group, uint32_t mcid)
+{
+	int ret;
 
-	ret = nl_socket_add_membership(state.nl_sock, mcid);
+	LOG_INFO_("Joining multicast group %s (%u)\n", group, mcid);
+	ret = transport_add_membership(state.nl_sock, mcid);
 	if (ret)
-		return ret;
+		LOG_ERR_("Unable to join multicast group %s: %s\n", group,
+			 nl_geterror(ret));
 
-	/* Scan multicast group */
-	mcid = nl_get_multicast_id(state.nl_sock, "nl80211", "scan");
-	if (mcid >= 0) {
-		ret = nl_socket_add_membership(state.nl_sock, mcid);
-		if (ret)
-			return ret;
+	return ret;
+}
+
+/* Join all multicast groups exported by nl80211 */
+static int join_all_groups(void)
+{
+	const struct genl_mcgrp *grps = nl80211_info.grps;
+	int i, ret;
+
+	if (!nl80211_info.n_grps) {
+		LOG_ERR_("nl80211 exports no multicast groups\n");
+		return -ENOENT;
 	}
 
-	/* Regulatory multicast group */
-	mcid = nl_get_multicast_id(state.nl_sock, "nl80211", "regulatory");
-	if (mcid >= 0) {
-		ret = nl_socket_add_membership(state.nl_sock, mcid);
+	for (i = 0; i < nl80211_info.n_grps; i++) {
+		ret = join_group(grps[i].name, grps[i].id);
 		if (ret)
 			return ret;
 	}
 
-	/* MLME multicast group */
-	mcid = nl_get_multicast_id(state.nl_sock, "nl80211", "mlme");
-	if (mcid >= 0) {
-		ret = nl_socket_add_membership(state.nl_sock, mcid);
+	return 0;
+}
+
+/*
+ * Join the multicast groups in the comma separated list groups.
+ * All groups in the list must exist.
+ */
+static int join_groups(const char *groups)
+{
+	char *str, *group, *saveptr;
+	int mcid, ret = 0;
+
+	str = strdup(groups);
+	if (!str)
+		return -ENOMEM;
+
+	for (group = strtok_r(str, ",", &saveptr); group;
+	     group = strtok_r(NULL, ",", &saveptr)) {
+		mcid = nl_family_group_id(&nl80211_info, group);
+		if (mcid < 0) {
+			LOG_ERR_("Unknown multicast group: %s\n", group);
+			ret = mcid;
+			break;
+		}
+		ret = join_group(group, mcid);
 		if (ret)
-			return ret;
+			break;
 	}
+	free(str);
+
+	return ret;
+}
 
-	mcid = nl_get_multicast_id(state.nl_sock, "nl80211", "vendor");
-	if (mcid >= 0) {
-		ret = nl_socket_add_membership(state.nl_sock, mcid);
+/* Join the default groups. Only the config group is mandatory. */
+static int join_default_groups(void)
+{
+	unsigned int i;
+	int mcid, ret;
+
+	for (i = 0; i < sizeof(default_groups) / sizeof(default_groups[0]);
+	     i++) {
+		mcid = nl_family_group_id(&nl80211_info, default_groups[i]);
+		if (mcid < 0) {
+			if (i == 0)
+				return mcid;
+			continue;
+		}
+		ret = join_group(default_groups[i], mcid);
 		if (ret)
 			return ret;
 	}
@@ -221,28 +418,289 @@ static int prepare_listen_events(void)
 	return 0;
 }
 
-static int do_listen_events(void)
+static int prepare_listen_events(void)
+{
+	int ret;
+
+	if (!listen_groups)
+		ret = join_default_groups();
+	else if (!strcmp(listen_groups, "all"))
+		ret = join_all_groups();
+	else
+		ret = join_groups(listen_groups);
+	if (ret)
+		return ret;
+
+	/* Let the kernel drop events not matching the filters. Events are
+	 * still matched in valid_handler(), so a failure is not fatal.
+	 * The flight recorder needs all events.
+	 */
+	if (flight_max)
+		return 0;
+	ret = filter_attach(transport_fd(state.nl_sock), state.nl80211_id);
+	if (ret)
+		LOG_WARN_("Unable to attach socket filter: %s\n",
+			  strerror(-ret));
+
+	return 0;
+}
+
+/*
+ * Called when there is nothing to receive. Flushes the output and
+ * returns the time (in ms) to wait for more data.
+ */
+static int listen_idle(void)
+{
+	int timeout = output_idle();
+	int stats_ms = stats_timeout();
+
+	if (capture)
+		(void) pcap_flush(capture);
+	if (stats_ms >= 0 && (timeout < 0 || stats_ms < timeout))
+		timeout = stats_ms;
+
+	return timeout;
+}
+
+/* Handle the messages received by the receive thread (--rx-ring) */
+static int listen_rx_ring(void)
+{
+	struct rxring_slot *slot;
+	bool hup = false;
+	int ret;
+
+	ret = rxring_start(state.nl_sock, rx_ring_slots);
+	if (ret)
+		return ret;
+
+	while (!hup) {
+		stats_poll();
+		flight_poll();
+		slot = rxring_peek();
+		if (!slot) {
+			rxring_wait(listen_idle());
+			continue;
+		}
+
+		switch (slot->type) {
+		case RXRING_MSG:
+			nlrecv_set_timestamp(slot->timestamp, slot->monotonic);
+			handle_message(slot->nlh);
+			break;
+		case RXRING_OVERRUN:
+			if (framed)
+				write_gap_record(slot->overruns);
+			break;
+		case RXRING_HUP:
+			hup = true;
+			break;
+		}
+		rxring_release();
+	}
+	rxring_stop();
+
+	return 0;
+}
+
+/* Handle the messages of a datagram received with io_uring */
+static void handle_datagram(uint8_t *buf, int len)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *) buf;
+
+	for (; nlmsg_ok(nlh, len); nlh = nlmsg_next(nlh, &len)) {
+		/* Only ACKs, errors and NOOPs have types below
+		 * NLMSG_MIN_TYPE. They are not expected in listen mode.
+		 */
+		if (nlh->nlmsg_type >= NLMSG_MIN_TYPE)
+			handle_message(nlh);
+	}
+}
+
+static int listen_socket(void);
+
+/*
+ * Receive (and write the output) with io_uring. Falls back to
+ * listen_socket() if io_uring is unavailable.
+ */
+static int listen_uring(void)
+{
+	uint8_t *buf;
+	size_t size;
+	uint64_t ts, mono;
+	ssize_t len;
+	bool hup = false;
+	int ret;
+
+	ret = uring_start(transport_fd(state.nl_sock), URING_RECV_BUFS_DEFAULT);
+	if (ret) {
+		LOG_WARN_("io_uring is unavailable (%s). Not using it\n",
+			  strerror(-ret));
+		return listen_socket();
+	}
+	/* Without output buffering, the output is written synchronously */
+	if (output_set_async(URING_OUTPUT_BUFS_DEFAULT))
+		LOG_INFO_("Output is written synchronously\n");
+
+	while (!hup) {
+		stats_poll();
+		flight_poll();
+		len = uring_recv(&buf, &size, &ts, &mono);
+		if (len == -EAGAIN) {
+			uring_wait(listen_idle());
+			continue;
+		}
+
+		if (!len) {
+			/* Only the mock kernel ever hangs up */
+			hup = true;
+		} else if (len == -ENOBUFS) {
+			sockbuf_overrun(state.nl_sock);
+			if (framed)
+				write_gap_record(sockbuf_overruns());
+		} else if (len < 0) {
+			LOG_ERR_("Receive failed: %s\n", strerror(-len));
+		} else if ((size_t) len > size) {
+			LOG_ERR_("Netlink message truncated (%zd bytes). Message lost\n",
+				 len);
+		} else {
+			nlrecv_set_timestamp(ts, mono);
+			handle_datagram(buf, len);
+		}
+		uring_recv_done();
+	}
+
+	if (output_flush())
+		LOG_ERR_("Failed to write output\n");
+	(void) output_set_async(0);
+	uring_stop();
+
+	return 0;
+}
+
+static int listen_socket(void)
 {
 	struct nl_cb *cb = nl_cb_alloc((log_level > LOG_WARNING) ?
 				       NL_CB_DEBUG : NL_CB_DEFAULT);
+	struct pollfd pfd;
+	bool hup = false;
 
 	if (!cb) {
 		LOG_ERR_("failed to allocate netlink callbacks\n");
 		return -ENOMEM;
 	}
 
+	nlrecv_setup(cb);
 	/* no sequence checking for multicast messages */
 	nl_cb_set(cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, no_seq_check, NULL);
 	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, valid_handler, NULL);
 
-	for (;;)
-		nl_recvmsgs(state.nl_sock, cb);
+	/* The socket is non blocking so that the buffered output can be
+	 * flushed as soon as there are no more events to receive.
+	 */
+	transport_set_nonblocking(state.nl_sock);
+	pfd.fd = transport_fd(state.nl_sock);
+	pfd.events = POLLIN;
 
+	for (;;) {
+		unsigned long prev_rx_count = rx_count;
+		int err;
+
+		stats_poll();
+		flight_poll();
+		err = nl_recvmsgs(state.nl_sock, cb);
+		/* Events have been dropped by the kernel. libnl reports
+		 * ENOBUFS as NLE_NOMEM.
+		 */
+		if (err == -NLE_NOMEM) {
+			sockbuf_overrun(state.nl_sock);
+			if (framed)
+				write_gap_record(sockbuf_overruns());
+			continue;
+		}
+		/* Depending on the libnl version, a read that would block
+		 * returns either 0 or -NLE_AGAIN.
+		 */
+		if (err == -NLE_AGAIN || (!err && rx_count == prev_rx_count)) {
+			int timeout;
+
+			/* Only the mock kernel ever hangs up (when all
+			 * events have been sent)
+			 */
+			if (hup)
+				break;
+			timeout = listen_idle();
+			if (poll(&pfd, 1, timeout) > 0 &&
+			    (pfd.revents & POLLHUP))
+				hup = true;
+		}
+	}
 	nl_cb_put(cb);
 
 	return 0;
 }
 
+/* Open the capture and the flight recorder and join the groups */
+static int listen_start(void)
+{
+	int ret;
+
+	if (pcap_path) {
+		capture = pcap_open(pcap_path, pcap_rotate_size,
+				    pcap_rotate_time);
+		if (!capture)
+			return -EIO;
+	}
+	if (flight_max) {
+		ret = flight_init(flight_max, flight_size, flight_window,
+				  flight_path, flight_trigger);
+		if (ret)
+			return ret;
+	}
+	ret = prepare_listen_events();
+	if (ret && nl80211_refresh(state.nl_sock))
+		ret = prepare_listen_events();
+
+	return ret;
+}
+
+static void listen_finish(void)
+{
+	if (output_flush())
+		LOG_ERR_("Failed to write output\n");
+	pcap_close(capture);
+	capture = NULL;
+}
+
+static int do_listen_events(void)
+{
+	int ret;
+
+	if (rx_ring_slots)
+		ret = listen_rx_ring();
+	else if (use_io_uring)
+		ret = listen_uring();
+	else
+		ret = listen_socket();
+
+	listen_finish();
+
+	return ret;
+}
+
+static void events_overrun(void)
+{
+	if (framed)
+		write_gap_record(sockbuf_overruns());
+}
+
+/* Events received together with batch responses (--events) */
+static const struct batch_events batch_events = {
+	.out_fd = 1,
+	.event = handle_message,
+	.overrun = events_overrun,
+	.idle = listen_idle,
+};
+
 static int phy_lookup(char *name)
 {
 	char buf[200];
@@ -279,19 +737,12 @@ static void add_nla_stream_to_msg(struct nl_msg *msg, void *nla, size_t nla_len)
 	hdr->nlmsg_len += nla_len;
 }
 
-static int send_recv_nlcmd(void *nla, size_t nla_len)
+struct nl_msg *build_nlcmd_msg(const struct nlcmd *c)
 {
-	int err, nla_offset = 0;
-	struct nl_cb *cb;
-	struct nl_cb *s_cb;
+	int nla_offset = 0;
 	struct nl_msg *msg;
 
-	if (cur_cmd <= NL80211_CMD_UNSPEC) {
-		LOG_ERR_("Unsupported nl command: %d\n", cur_cmd);
-		return 1;
-	}
-
-	if (devidx_set)
+	if (c->devidx_attr)
 		/* Since devidx is a uint32_t the attribute will consume 8
 		 * bytes. The nla input stream must be appended after this
 		 * attribute.
@@ -299,13 +750,79 @@ static int send_recv_nlcmd(void *nla, size_t nla_len)
 		nla_offset = 8;
 
 	LOG_DBG_("%s: Allocating %d bytes for nlmsg\n", __func__,
-		  nla_len + nla_offset + NLMSG_HDRLEN + GENL_HDRLEN);
-	msg = nlmsg_alloc_size(nla_len + nla_offset + NLMSG_HDRLEN + GENL_HDRLEN);
+		  c->nla_len + nla_offset + NLMSG_HDRLEN + GENL_HDRLEN);
+	msg = nlmsg_alloc_size(c->nla_len + nla_offset + NLMSG_HDRLEN +
+			       GENL_HDRLEN);
 	if (!msg) {
 		LOG_ERR_("failed to allocate netlink message\n");
-		return 2;
+		return NULL;
 	}
 
+	genlmsg_put(msg, 0, 0, state.nl80211_id, 0, 0, c->cmd, 0);
+
+	if (c->devidx_attr) {
+		LOG_DBG_("%s: Adding devidx %d attribute\n", __func__,
+			 c->devidx);
+		NLA_PUT_U32(msg, c->devidx_attr, c->devidx);
+	}
+
+	add_nla_stream_to_msg(msg, c->nla, c->nla_len);
+
+	return msg;
+
+ nla_put_failure:
+	LOG_ERR_("building message failed\n");
+	nlmsg_free(msg);
+	return NULL;
+}
+
+/*
+ * Wait until the socket is readable or the time deadline_ns (monotonic_ns())
+ * has passed (0 means no deadline). Returns -ETIMEDOUT when it has.
+ */
+static int wait_response(uint64_t deadline_ns)
+{
+	struct pollfd pfd;
+	uint64_t now;
+	int ret;
+
+	if (!deadline_ns)
+		return 0;
+
+	pfd.fd = transport_fd(state.nl_sock);
+	pfd.events = POLLIN;
+	for (;;) {
+		now = monotonic_ns();
+		if (now >= deadline_ns)
+			return -ETIMEDOUT;
+		ret = poll(&pfd, 1, (deadline_ns - now + 999999) / 1000000);
+		if (ret > 0)
+			return 0;
+		if (ret < 0 && errno != EINTR)
+			return -errno;
+	}
+}
+
+/*
+ * Send a message built by build_nlcmd_msg() and wait for the response.
+ * The message can be sent again (a new sequence number is assigned
+ * each time).
+ *
+ * With --timeout, the socket is non blocking and only read when poll()
+ * says it is readable, so a response that never arrives (or stops
+ * arriving halfway through a dump) fails the request with -ETIMEDOUT
+ * instead of blocking forever.
+ */
+static int send_recv_nlmsg(struct nl_msg *msg, nl_recvmsg_msg_cb_t valid_cb,
+			   void *arg)
+{
+	int err;
+	struct nl_cb *cb;
+	struct nl_cb *s_cb;
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	uint64_t sent_ns, deadline_ns = 0;
+	uint32_t seq;
+
 	cb = nl_cb_alloc((log_level > LOG_WARNING) ?
 			 NL_CB_DEBUG : NL_CB_DEFAULT);
 	s_cb = nl_cb_alloc((log_level > LOG_WARNING) ?
@@ -316,46 +833,81 @@ static int send_recv_nlcmd(void *nla, size_t nla_len)
 		goto out;
 	}
 
-	genlmsg_put(msg, 0, 0, state.nl80211_id, 0, 0, cur_cmd, 0);
-
-	if (devidx_set) {
-		LOG_DBG_("%s: Adding devidx %d attribute\n", __func__, devidx);
-		if (dev_by_phy)
-			NLA_PUT_U32(msg, NL80211_ATTR_WIPHY, devidx);
-		else
-			NLA_PUT_U32(msg, NL80211_ATTR_IFINDEX, devidx);
-	}
-
-	add_nla_stream_to_msg(msg, nla, nla_len);
-
 	nl_socket_set_cb(state.nl_sock, s_cb);
 
-	err = nl_send_auto_complete(state.nl_sock, msg);
+	nlmsg_hdr(msg)->nlmsg_seq = NL_AUTO_SEQ;
+	sent_ns = monotonic_ns();
+	err = transport_send(state.nl_sock, msg);
 	if (err < 0) {
-		LOG_ERR_("nl_send_auto_complete %d\n", err);
+		LOG_ERR_("Failed to send message: %s\n", nl_geterror(err));
 		goto out;
 	}
 
 	err = 1;
+	seq = nlmsg_hdr(msg)->nlmsg_seq;
+	if (request_timeout_ms)
+		deadline_ns = sent_ns + request_timeout_ms * 1000000ULL;
 
+	nlrecv_setup(cb);
+	nl_cb_set(cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, seq_check, &seq);
 	nl_cb_err(cb, NL_CB_CUSTOM, error_handler, &err);
 	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, &err);
 	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, ack_handler, &err);
-	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, valid_handler, NULL);
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, valid_cb, arg);
+
+	while (err > 0) {
+		int ret = wait_response(deadline_ns);
 
-	while (err > 0)
-		nl_recvmsgs(state.nl_sock, cb);
+		if (ret) {
+			if (ret == -ETIMEDOUT)
+				LOG_ERR_("No response to %s within %u ms\n",
+					 command_name(gnlh->cmd),
+					 request_timeout_ms);
+			err = ret;
+			break;
+		}
+		ret = nl_recvmsgs(state.nl_sock, cb);
+		/* A stalled multipart response ends up here (and the
+		 * rest of it is waited for). Errors reported by the
+		 * callbacks have already completed the request.
+		 */
+		if (ret == -NLE_AGAIN || ret >= 0 || err <= 0)
+			continue;
+		LOG_ERR_("Failed to receive response to %s: %s\n",
+			 command_name(gnlh->cmd), nl_geterror(ret));
+		err = -EIO;
+	}
+
+	stats_latency(STATS_HIST_SEND_ACK, monotonic_ns() - sent_ns);
+	stats_request(gnlh->cmd, err);
  out:
 	nl_cb_put(cb);
 	nl_cb_put(s_cb);
+	return err;
+}
+
+int send_recv_nlcmd(const struct nlcmd *c, nl_recvmsg_msg_cb_t valid_cb,
+		    void *arg)
+{
+	struct nl_msg *msg;
+	int err;
+
+	if (c->cmd <= NL80211_CMD_UNSPEC) {
+		LOG_ERR_("Unsupported nl command: %d\n", c->cmd);
+		return 1;
+	}
+
+	msg = build_nlcmd_msg(c);
+	if (!msg)
+		return 2;
+
+	err = send_recv_nlmsg(msg, valid_cb, arg);
 	nlmsg_free(msg);
+
 	return err;
- nla_put_failure:
-	LOG_ERR_("building message failed\n");
-	return 2;
 }
 
-static int validate_nla_stream(uint8_t *buf, size_t buflen)
+int validate_nla_stream(uint8_t *buf, size_t buflen)
 {
 	struct nlattr *cur_attr;
 	int remaining, attr_cnt = 0;
@@ -402,16 +954,185 @@ static ssize_t read_nla_stream(uint8_t *buf, size_t buflen)
 	return n;
 }
 
+static void init_nlcmd(struct nlcmd *c)
+{
+	memset(c, 0, sizeof(*c));
+	c->cmd = cur_cmd;
+	if (devidx_set) {
+		c->devidx_attr = dev_by_phy ? NL80211_ATTR_WIPHY :
+					      NL80211_ATTR_IFINDEX;
+		c->devidx = devidx;
+	}
+}
+
+/* Write the status record of a command (framed output only) */
+static void write_status_record(enum nl80211_commands cmd, int rc)
+{
+	struct iwraw_rec_hdr hdr;
+
+	if (!framed)
+		return;
+
+	record_init(&hdr, IWRAW_REC_STATUS, NULL, rec_seq++);
+	hdr.cmd = cmd;
+	hdr.status = rc > 0 ? -EINVAL : rc;
+	if (output_write(&hdr, sizeof(hdr), NULL, 0))
+		LOG_ERR_("Failed to write record\n");
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* p:th percentile (nearest rank) of n sorted values */
+static double percentile_us(const uint64_t *sorted, unsigned int n, double p)
+{
+	unsigned int rank = (unsigned int) (p / 100.0 * n);
+
+	if (rank < p / 100.0 * n)
+		rank++;
+	if (rank < 1)
+		rank = 1;
+	if (rank > n)
+		rank = n;
+
+	return sorted[rank - 1] / 1000.0;
+}
+
+/*
+ * Send the command send_repeat times (at most send_rate times per second
+ * if a rate is given) and report the send to ACK latency distribution
+ * and the throughput on stderr.
+ * The message is only built once. Each request waits for the response
+ * of the previous one. If the rate can't be kept up, requests are sent
+ * back to back until the schedule has been caught up.
+ */
+static int do_send_repeat(const struct nlcmd *c)
+{
+	uint64_t *lat, start, next, elapsed, interval_ns = 0;
+	unsigned int i, errors = 0;
+	struct nl_msg *msg;
+	int rc = 0;
+
+	if (c->cmd <= NL80211_CMD_UNSPEC) {
+		LOG_ERR_("Unsupported nl command: %d\n", c->cmd);
+		return 1;
+	}
+
+	msg = build_nlcmd_msg(c);
+	lat = malloc(send_repeat * sizeof(*lat));
+	if (!msg || !lat) {
+		nlmsg_free(msg);
+		free(lat);
+		return 2;
+	}
+
+	if (send_rate > 0)
+		interval_ns = 1000000000.0 / send_rate;
+
+	start = next = monotonic_ns();
+	for (i = 0; i < send_repeat; i++) {
+		uint64_t t0;
+		int err;
+
+		if (interval_ns) {
+			sleep_until(next);
+			next += interval_ns;
+		}
+
+		t0 = monotonic_ns();
+		err = send_recv_nlmsg(msg, valid_handler, NULL);
+		lat[i] = monotonic_ns() - t0;
+		write_status_record(c->cmd, err);
+		if (err) {
+			errors++;
+			rc = err;
+		}
+	}
+	elapsed = monotonic_ns() - start;
+
+	qsort(lat, send_repeat, sizeof(*lat), cmp_u64);
+	fprintf(stderr, "%s: %u requests, %u errors, %.3f ms, %.1f requests/s\n",
+		command_name(c->cmd), send_repeat, errors, elapsed / 1e6,
+		send_repeat * 1e9 / elapsed);
+	fprintf(stderr, "latency (us): min %.1f p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+		lat[0] / 1000.0,
+		percentile_us(lat, send_repeat, 50),
+		percentile_us(lat, send_repeat, 99),
+		percentile_us(lat, send_repeat, 99.9),
+		lat[send_repeat - 1] / 1000.0);
+
+	free(lat);
+	nlmsg_free(msg);
+
+	return rc;
+}
+
 static int run_iwraw(void)
 {
+	struct nlcmd c;
 	int rc;
 
 	rc = nl80211_init();
 	if (rc)
 		return rc;
 
-	if (!cmd_set) {
-		rc = prepare_listen_events();
+	rc = output_init(1, output_buf_size, output_flush_ms,
+			 output_flush_idle);
+	if (rc)
+		return rc;
+
+	init_nlcmd(&c);
+	stats_init(stats_path, stats_interval);
+
+	/* A blocking read could still hang in the middle of a multipart
+	 * response, even if poll() said the socket was readable. Only
+	 * the modes that send requests are affected (listen mode has a
+	 * receive path of its own, and io_uring needs a blocking socket).
+	 */
+	if (request_timeout_ms && (cmd_set || batch_mode || daemon_path)) {
+		rc = transport_set_nonblocking(state.nl_sock);
+		if (rc) {
+			LOG_ERR_("Unable to make socket non blocking: %s\n",
+				 strerror(-rc));
+			return rc;
+		}
+	}
+
+	if (listen_events && (daemon_path || batch_mode)) {
+		/* Events and responses share stdout, so they must be
+		 * told apart
+		 */
+		framed = true;
+		rc = listen_start();
+		if (rc)
+			return rc;
+		rc = do_daemon(daemon_path, batch_mode ? 0 : -1, 1,
+			       &batch_events, &c, batch_window,
+			       request_timeout_ms);
+		listen_finish();
+	} else if (daemon_path) {
+		rc = do_daemon(daemon_path, -1, -1, NULL, &c, batch_window,
+			       request_timeout_ms);
+	} else if (batch_mode) {
+		rc = do_batch(0, 1, &c, batch_window, request_timeout_ms);
+	} else if (!cmd_set) {
+		rc = listen_start();
 		if (rc)
 			return rc;
 		rc = do_listen_events();
@@ -422,9 +1143,26 @@ static int run_iwraw(void)
 						 sizeof(nla_input_stream));
 		if (nla_stream_len < 0)
 			return -1;
-		rc = send_recv_nlcmd(nla_input_stream, nla_stream_len);
+		c.nla = nla_input_stream;
+		c.nla_len = nla_stream_len;
+		if (send_repeat > 1 || send_rate > 0) {
+			rc = do_send_repeat(&c);
+		} else {
+			rc = send_recv_nlcmd(&c, valid_handler, NULL);
+			/* An unknown family id is reported as ENOENT */
+			if (rc == -ENOENT && nl80211_refresh(state.nl_sock))
+				rc = send_recv_nlcmd(&c, valid_handler, NULL);
+			write_status_record(c.cmd, rc);
+		}
+		/* A timeout gets an exit status of its own */
+		if (rc == -ETIMEDOUT)
+			rc = IWRAW_EXIT_TIMEOUT;
+		if (output_flush())
+			LOG_ERR_("Failed to write output\n");
 	}
 
+	stats_exit();
+
 	return rc;
 }
 
@@ -451,12 +1189,101 @@ static void print_usage(char *argv0)
 	fprintf(stderr, "                     to list all available commands.\n");
 	fprintf(stderr, "  -a, --ascii        ASCII output. Print output in ASCII format\n");
 	fprintf(stderr, "                     instead of binary.\n");
+	fprintf(stderr, "  --filter EXPR      Only output events matching EXPR (listen\n");
+	fprintf(stderr, "                     mode). May be given several times.\n");
+	fprintf(stderr, "  --groups LIST      Comma separated list of nl80211 multicast\n");
+	fprintf(stderr, "                     groups to listen to, or \"all\" for all\n");
+	fprintf(stderr, "                     groups (default config,scan,regulatory,\n");
+	fprintf(stderr, "                     mlme,vendor).\n");
+	fprintf(stderr, "  --write-pcap FILE  Write the events to the pcap file FILE\n");
+	fprintf(stderr, "                     (LINKTYPE_NETLINK) instead of stdout\n");
+	fprintf(stderr, "                     (listen mode).\n");
+	fprintf(stderr, "  --pcap-rotate-size BYTES\n");
+	fprintf(stderr, "                     Start a new capture file (FILE1, FILE2,\n");
+	fprintf(stderr, "                     ...) when the current one reaches BYTES.\n");
+	fprintf(stderr, "  --pcap-rotate-time S\n");
+	fprintf(stderr, "                     Start a new capture file every S seconds.\n");
+	fprintf(stderr, "  --flight-recorder N\n");
+	fprintf(stderr, "                     Keep the last N events in memory and\n");
+	fprintf(stderr, "                     write them to a pcap file on SIGUSR2.\n");
+	fprintf(stderr, "  --flight-recorder-size BYTES\n");
+	fprintf(stderr, "                     Memory for the recorded events\n");
+	fprintf(stderr, "                     (default %d).\n",
+		FLIGHT_SIZE_DEFAULT);
+	fprintf(stderr, "  --flight-recorder-time S\n");
+	fprintf(stderr, "                     Only write the events of the last\n");
+	fprintf(stderr, "                     S seconds.\n");
+	fprintf(stderr, "  --flight-recorder-file PATH\n");
+	fprintf(stderr, "                     Write the events to PATH.<time>.<n>\n");
+	fprintf(stderr, "                     (default %s).\n",
+		FLIGHT_PATH_DEFAULT);
+	fprintf(stderr, "  --flight-trigger EXPR\n");
+	fprintf(stderr, "                     Also write the events when an event\n");
+	fprintf(stderr, "                     matching the filter EXPR is received.\n");
+	fprintf(stderr, "  --rx-ring SLOTS    Receive events in a separate thread,\n");
+	fprintf(stderr, "                     buffering up to SLOTS events while the\n");
+	fprintf(stderr, "                     output is blocked (listen mode).\n");
+	fprintf(stderr, "  --io-uring         Receive events and write the output with\n");
+	fprintf(stderr, "                     io_uring (listen mode).\n");
+	fprintf(stderr, "  --framed           Framed output. Write each message as a\n");
+	fprintf(stderr, "                     record with a fixed size header.\n");
+	fprintf(stderr, "  --flush-size BYTES Size of the output buffer. Output is written\n");
+	fprintf(stderr, "                     when the buffer is full (default %d).\n",
+		OUTPUT_BUF_SIZE_DEFAULT);
+	fprintf(stderr, "                     0 disables output buffering.\n");
+	fprintf(stderr, "  --flush-ms MS      Max time output may stay in the buffer\n");
+	fprintf(stderr, "                     (default %d). 0 means no limit.\n",
+		OUTPUT_FLUSH_MS_DEFAULT);
+	fprintf(stderr, "  --no-flush-idle    Don't flush the output buffer as soon as\n");
+	fprintf(stderr, "                     there are no more events to receive.\n");
+	fprintf(stderr, "  --repeat N         Send the command N times and report the\n");
+	fprintf(stderr, "                     latency distribution and throughput.\n");
+	fprintf(stderr, "  --rate R           Send at most R commands per second.\n");
 	fprintf(stderr, "  -v, --verbose      Enable debug prints (each -v option\n");
 	fprintf(stderr, "                     increases the verbosity level)\n");
 	fprintf(stderr, "  --if, --interface  Wireless Network interface. Use this\n");
 	fprintf(stderr, "                     option or --phy\n");
 	fprintf(stderr, "  --phy              Wireless Network phy. Use this option\n");
 	fprintf(stderr, "                     or --if | --interface\n");
+	fprintf(stderr, "  --batch            Batch mode. Read request records from stdin,\n");
+	fprintf(stderr, "                     execute them over one netlink socket and\n");
+	fprintf(stderr, "                     write response records to stdout.\n");
+	fprintf(stderr, "  --daemon PATH      Daemon mode (iwrawd). Serve batch requests\n");
+	fprintf(stderr, "                     from clients connecting to the Unix domain\n");
+	fprintf(stderr, "                     socket PATH.\n");
+	fprintf(stderr, "  --window           Max number of outstanding requests in\n");
+	fprintf(stderr, "                     batch and daemon mode (default 1).\n");
+	fprintf(stderr, "  --events           Also listen for events in batch and daemon\n");
+	fprintf(stderr, "                     mode. Events are written to stdout as\n");
+	fprintf(stderr, "                     framed records, together with the batch\n");
+	fprintf(stderr, "                     responses.\n");
+	fprintf(stderr, "  --timeout MS       Fail a request that has not been answered\n");
+	fprintf(stderr, "                     within MS milliseconds (default 0, no\n");
+	fprintf(stderr, "                     timeout). In send command mode, iwraw\n");
+	fprintf(stderr, "                     then exits with status %d.\n",
+		IWRAW_EXIT_TIMEOUT);
+	fprintf(stderr, "  --rcvbuf BYTES     Netlink socket receive buffer size\n");
+	fprintf(stderr, "                     (default %d). The buffer grows\n",
+		SOCKBUF_RCVBUF_DEFAULT);
+	fprintf(stderr, "                     automatically if it overflows.\n");
+	fprintf(stderr, "  --sndbuf BYTES     Netlink socket send buffer size\n");
+	fprintf(stderr, "                     (default %d).\n",
+		SOCKBUF_SNDBUF_DEFAULT);
+	fprintf(stderr, "  --stats-file FILE  Write runtime statistics to FILE\n");
+	fprintf(stderr, "                     periodically and on SIGUSR1 (without\n");
+	fprintf(stderr, "                     this option, SIGUSR1 prints them to stderr).\n");
+	fprintf(stderr, "  --stats-interval S Seconds between stats file updates\n");
+	fprintf(stderr, "                     (default %d).\n",
+		STATS_INTERVAL_DEFAULT);
+	fprintf(stderr, "  --cache FILE       Cache the nl80211 family and multicast\n");
+	fprintf(stderr, "                     group ids in FILE (valid until reboot).\n");
+	fprintf(stderr, "  --mock SCRIPT      Talk to a mock nl80211 kernel running the\n");
+	fprintf(stderr, "                     script SCRIPT instead of the kernel.\n");
+	fprintf(stderr, "  --replay FILE      Replay the events of the capture FILE\n");
+	fprintf(stderr, "                     (see --write-pcap) through the mock\n");
+	fprintf(stderr, "                     kernel. Exits at the end of the capture.\n");
+	fprintf(stderr, "  --replay-speed X   Replay X times faster than captured\n");
+	fprintf(stderr, "                     (default 1). 0 replays as fast as possible.\n");
 	fprintf(stderr, "  --print-commands   Print all available commands and exit\n");
 	fprintf(stderr, "  --syslog           Log to syslog instead of stderr.\n");
 	fprintf(stderr, "  --version          Print version info and exit.\n");
@@ -468,6 +1295,15 @@ static void print_usage(char *argv0)
 	fprintf(stderr, "If any of these arguments is omitted, the user is responsible\n");
 	fprintf(stderr, "for adding the if index to the input nla stream (if needed).\n");
 	fprintf(stderr, "\n");
+	fprintf(stderr, "A filter expression is a comma separated list of conditions\n");
+	fprintf(stderr, "that must all be true for an event to match:\n");
+	fprintf(stderr, "cmd=<name|id>, ifindex=<n>, if=<name>, wiphy=<n>,\n");
+	fprintf(stderr, "vendor=<id>[:<subcmd>] and subcmd=<n>.\n");
+	fprintf(stderr, "An event is written if it matches any of the filters.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "In batch mode, --interface or --phy is used for all requests\n");
+	fprintf(stderr, "that don't carry a device index of their own.\n");
+	fprintf(stderr, "\n");
 }
 
 static void print_version(void)
@@ -479,9 +1315,29 @@ static void print_version(void)
 #endif
 }
 
+/*
+ * Parse the numeric value of an option. Unlike a plain strtoull(), an
+ * empty string, trailing garbage (e.g. "2s"), a negative number or a
+ * value larger than max gives -EINVAL.
+ */
+static int parse_number(const char *str, uint64_t max, uint64_t *val)
+{
+	char *end;
+
+	if (strchr(str, '-'))
+		return -EINVAL;
+	errno = 0;
+	*val = strtoull(str, &end, 0);
+	if (errno || end == str || *end || *val > max)
+		return -EINVAL;
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	int opt, optind = 0;
+	uint64_t val;
 	struct option long_opts[] = {
 		{"help", no_argument, 0, 'h'},
 		{"command", required_argument, 0, 'c'},
@@ -493,6 +1349,37 @@ int main(int argc, char **argv)
 		{"print-commands", no_argument, 0, 1003},
 		{"version", no_argument, 0, 1004},
 		{"syslog", no_argument, 0, 1005},
+		{"batch", no_argument, 0, 1006},
+		{"window", required_argument, 0, 1007},
+		{"daemon", required_argument, 0, 1008},
+		{"framed", no_argument, 0, 1009},
+		{"flush-size", required_argument, 0, 1010},
+		{"flush-ms", required_argument, 0, 1011},
+		{"no-flush-idle", no_argument, 0, 1012},
+		{"filter", required_argument, 0, 1013},
+		{"groups", required_argument, 0, 1014},
+		{"cache", required_argument, 0, 1015},
+		{"rcvbuf", required_argument, 0, 1016},
+		{"sndbuf", required_argument, 0, 1017},
+		{"stats-file", required_argument, 0, 1018},
+		{"stats-interval", required_argument, 0, 1019},
+		{"repeat", required_argument, 0, 1020},
+		{"rate", required_argument, 0, 1021},
+		{"mock", required_argument, 0, 1022},
+		{"write-pcap", required_argument, 0, 1023},
+		{"pcap-rotate-size", required_argument, 0, 1024},
+		{"pcap-rotate-time", required_argument, 0, 1025},
+		{"replay", required_argument, 0, 1026},
+		{"replay-speed", required_argument, 0, 1027},
+		{"flight-recorder", required_argument, 0, 1028},
+		{"flight-recorder-size", required_argument, 0, 1029},
+		{"flight-recorder-time", required_argument, 0, 1030},
+		{"flight-recorder-file", required_argument, 0, 1031},
+		{"flight-trigger", required_argument, 0, 1032},
+		{"rx-ring", required_argument, 0, 1033},
+		{"io-uring", no_argument, 0, 1034},
+		{"events", no_argument, 0, 1035},
+		{"timeout", required_argument, 0, 1036},
 		{NULL, 0, 0, 0},
 	};
 
@@ -519,6 +1406,178 @@ int main(int argc, char **argv)
 		case 1005:
 			log_stderr = false;
 			break;
+		case 1006:
+			batch_mode = true;
+			break;
+		case 1007:
+			batch_window = atoi(optarg);
+			if (batch_window < 1 || batch_window > BATCH_WINDOW_MAX) {
+				fprintf(stderr, "Invalid window size: %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 1008:
+			daemon_path = optarg;
+			break;
+		case 1009:
+			framed = true;
+			break;
+		case 1010:
+			if (parse_number(optarg, SIZE_MAX, &val)) {
+				fprintf(stderr, "Invalid flush size: %s\n",
+					optarg);
+				return 1;
+			}
+			output_buf_size = val;
+			break;
+		case 1011:
+			if (parse_number(optarg, UINT_MAX, &val)) {
+				fprintf(stderr, "Invalid flush time: %s\n",
+					optarg);
+				return 1;
+			}
+			output_flush_ms = val;
+			break;
+		case 1012:
+			output_flush_idle = false;
+			break;
+		case 1013:
+			if (filter_add(optarg))
+				return 1;
+			break;
+		case 1014:
+			listen_groups = optarg;
+			break;
+		case 1015:
+			cache_path = optarg;
+			break;
+		case 1016:
+			rcvbuf = strtol(optarg, NULL, 0);
+			if (rcvbuf <= 0) {
+				fprintf(stderr, "Invalid receive buffer size: %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 1017:
+			sndbuf = strtol(optarg, NULL, 0);
+			if (sndbuf <= 0) {
+				fprintf(stderr, "Invalid send buffer size: %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 1018:
+			stats_path = optarg;
+			break;
+		case 1019:
+			stats_interval = atoi(optarg);
+			if (stats_interval < 1) {
+				fprintf(stderr, "Invalid stats interval: %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 1020:
+			send_repeat = strtoul(optarg, NULL, 0);
+			if (send_repeat < 1) {
+				fprintf(stderr, "Invalid repeat count: %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 1021:
+			send_rate = strtod(optarg, NULL);
+			if (send_rate <= 0) {
+				fprintf(stderr, "Invalid rate: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 1022:
+			mock_path = optarg;
+			break;
+		case 1023:
+			pcap_path = optarg;
+			break;
+		case 1024:
+			if (parse_number(optarg, UINT64_MAX, &val)) {
+				fprintf(stderr, "Invalid rotation size: %s\n",
+					optarg);
+				return 1;
+			}
+			pcap_rotate_size = val;
+			break;
+		case 1025:
+			if (parse_number(optarg, UINT_MAX, &val)) {
+				fprintf(stderr, "Invalid rotation time: %s\n",
+					optarg);
+				return 1;
+			}
+			pcap_rotate_time = val;
+			break;
+		case 1026:
+			replay_path = optarg;
+			break;
+		case 1027:
+			replay_speed = strtod(optarg, NULL);
+			if (replay_speed < 0) {
+				fprintf(stderr, "Invalid replay speed: %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 1028:
+			flight_max = strtoul(optarg, NULL, 0);
+			if (flight_max < 1) {
+				fprintf(stderr, "Invalid number of events: %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 1029:
+			flight_size = strtoul(optarg, NULL, 0);
+			if (flight_size < 1 || flight_size > UINT32_MAX) {
+				fprintf(stderr, "Invalid flight recorder size: %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 1030:
+			if (parse_number(optarg, UINT_MAX, &val)) {
+				fprintf(stderr, "Invalid flight recorder time: %s\n",
+					optarg);
+				return 1;
+			}
+			flight_window = val;
+			break;
+		case 1031:
+			flight_path = optarg;
+			break;
+		case 1032:
+			flight_trigger = optarg;
+			break;
+		case 1033:
+			rx_ring_slots = strtoul(optarg, NULL, 0);
+			if (rx_ring_slots < 1) {
+				fprintf(stderr, "Invalid number of slots: %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 1034:
+			use_io_uring = true;
+			break;
+		case 1035:
+			listen_events = true;
+			break;
+		case 1036:
+			if (parse_number(optarg, UINT_MAX, &val)) {
+				fprintf(stderr, "Invalid timeout: %s\n", optarg);
+				return 1;
+			}
+			request_timeout_ms = val;
+			break;
 		case 'a':
 			print_ascii = true;
 			break;
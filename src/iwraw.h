@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _IWRAW_H_
+#define _IWRAW_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <netlink/netlink.h>
+#include <netlink/handlers.h>
+#include <linux/genetlink.h>
+#include "nl80211.h"
+#include "record.h"
+
+struct nl80211_state {
+	struct nl_sock *nl_sock;
+	int nl80211_id;
+};
+
+/* A single nl80211 command to be sent to the kernel */
+struct nlcmd {
+	enum nl80211_commands cmd;
+	/* NL80211_ATTR_IFINDEX, NL80211_ATTR_WIPHY or 0 (no device index) */
+	int devidx_attr;
+	uint32_t devidx;
+	void *nla;
+	size_t nla_len;
+};
+
+extern struct nl80211_state state;
+
+/* genl.c */
+#define GENL_MCGRP_MAX 32
+
+struct genl_mcgrp {
+	char name[GENL_NAMSIZ];
+	uint32_t id;
+};
+
+struct genl_family_info {
+	int id;
+	int n_grps;
+	struct genl_mcgrp grps[GENL_MCGRP_MAX];
+};
+
+int nl_get_family(struct nl_sock *sock, const char *family,
+		  struct genl_family_info *info, unsigned int timeout_ms);
+int nl_family_group_id(const struct genl_family_info *info, const char *group);
+
+/* cache.c */
+int family_cache_load(const char *path, const char *family,
+		      struct genl_family_info *info);
+int family_cache_store(const char *path, const char *family,
+		       const struct genl_family_info *info);
+
+/* util.c */
+enum nl80211_commands nl80211_cmd_from_str(const char *str);
+void print_nl80211_cmds(void);
+const char *command_name(enum nl80211_commands cmd);
+
+/* iwraw.c */
+#define IWRAW_EXIT_TIMEOUT 124	/* Like timeout(1) */
+
+int no_seq_check(struct nl_msg *msg, void *arg);
+int validate_nla_stream(uint8_t *buf, size_t buflen);
+struct nl_msg *build_nlcmd_msg(const struct nlcmd *c);
+bool nl80211_refresh_busy(void);
+int send_recv_nlcmd(const struct nlcmd *c, nl_recvmsg_msg_cb_t valid_cb,
+		    void *arg);
+
+/* batch.c */
+#define BATCH_WINDOW_MAX 256
+#define BATCH_REQ_MAX_LEN (64 * 1024)
+
+struct batch;
+
+/* Multicast events received on the request socket */
+struct batch_events {
+	int out_fd;		/* The events are written to out_fd */
+	void (*event)(const struct nlmsghdr *nlh);
+	void (*overrun)(void);
+	/* Nothing to receive. Returns the poll timeout in ms */
+	int (*idle)(void);
+};
+
+ssize_t read_full(int fd, void *buf, size_t len);
+struct batch *batch_alloc(unsigned int window, unsigned int timeout_ms);
+void batch_free(struct batch *b);
+void batch_set_events(struct batch *b, const struct batch_events *events);
+void batch_set_writer(struct batch *b,
+		      int (*write)(int fd, const struct iwraw_rec_hdr *hdr,
+				   const void *data, size_t data_len));
+bool batch_failed(const struct batch *b);
+bool batch_full(const struct batch *b);
+unsigned int batch_inflight(const struct batch *b);
+void batch_submit(struct batch *b, const struct iwraw_req_hdr *hdr,
+		  void *nla, const struct nlcmd *defaults, int out_fd,
+		  uint32_t seq);
+int batch_recv(struct batch *b);
+int batch_timeout(const struct batch *b);
+void batch_expire(struct batch *b);
+int batch_flush(struct batch *b);
+void batch_detach_fd(struct batch *b, int out_fd);
+unsigned int batch_pending(struct batch *b, int out_fd);
+int do_batch(int in_fd, int out_fd, const struct nlcmd *defaults,
+	     unsigned int window, unsigned int timeout_ms);
+
+/* output.c */
+#define OUTPUT_BUF_SIZE_DEFAULT (64 * 1024)
+#define OUTPUT_FLUSH_MS_DEFAULT 100
+#define OUTPUT_ASYNC_BUFS_MAX 8
+
+int write_full(int fd, const void *buf, size_t len);
+int write_record(int fd, const struct iwraw_rec_hdr *hdr,
+		 const void *data, size_t data_len);
+uint64_t timestamp_ns(void);
+uint64_t monotonic_ns(void);
+uint32_t genlmsg_get_u32(const struct nlmsghdr *nlh, int attrtype);
+void record_init(struct iwraw_rec_hdr *hdr, uint16_t type,
+		 const struct nlmsghdr *nlh, uint32_t seq);
+int output_init(int fd, size_t size, unsigned int flush_ms, bool flush_idle);
+int output_write(const void *hdr, size_t hdr_len, const void *data,
+		 size_t data_len);
+int output_write_hex(const uint8_t *data, size_t len);
+int output_flush(void);
+int output_idle(void);
+int output_set_async(unsigned int n_bufs);
+void output_write_done(const void *buf, size_t len, int err, uint64_t ns);
+
+/* filter.c */
+#define FILTER_MAX_RULES 32
+
+#define FILTER_CMD		(1 << 0)
+#define FILTER_IFINDEX		(1 << 1)
+#define FILTER_WIPHY		(1 << 2)
+#define FILTER_VENDOR_ID	(1 << 3)
+#define FILTER_SUBCMD		(1 << 4)
+
+/* All conditions in mask (FILTER_*) must be true for an event to match */
+struct filter_rule {
+	uint32_t mask;
+	uint32_t cmd;
+	uint32_t ifindex;
+	uint32_t wiphy;
+	uint32_t vendor_id;
+	uint32_t subcmd;
+};
+
+int filter_rule_parse(const char *expr, struct filter_rule *rule);
+bool filter_rule_match(const struct filter_rule *rule,
+		       const struct nlmsghdr *nlh);
+int filter_add(const char *expr);
+bool filter_active(void);
+const struct filter_rule *filter_rules(unsigned int *n);
+bool filter_match(const struct nlmsghdr *nlh);
+int filter_attach(int fd, int nl80211_id);
+
+/* sockbuf.c */
+#define SOCKBUF_RCVBUF_DEFAULT (256 * 1024)
+#define SOCKBUF_SNDBUF_DEFAULT (32 * 1024)
+#define SOCKBUF_RCVBUF_MAX (16 * 1024 * 1024)
+
+int sockbuf_init(struct nl_sock *sk, int rcvbuf, int sndbuf);
+int sockbuf_grow_rcvbuf(struct nl_sock *sk, int size);
+void sockbuf_overrun(struct nl_sock *sk);
+unsigned long sockbuf_overruns(void);
+
+/* nlrecv.c */
+void nlrecv_setup(struct nl_cb *cb);
+uint64_t nlrecv_timestamp(void);
+uint64_t nlrecv_monotonic(void);
+void nlrecv_set_timestamp(uint64_t ts, uint64_t mono);
+
+/* rxring.c */
+/* Messages up to this size are stored in the slot itself */
+#define RXRING_SLOT_SIZE 4096
+
+enum rxring_type {
+	RXRING_MSG,		/* A received message */
+	RXRING_OVERRUN,		/* Messages were dropped by the kernel */
+	RXRING_HUP,		/* The socket was closed (mock kernel only) */
+};
+
+struct rxring_slot {
+	enum rxring_type type;
+	uint64_t timestamp;	/* Receive time */
+	uint64_t monotonic;	/* Receive time (monotonic_ns()) */
+	unsigned long overruns;	/* sockbuf_overruns() */
+	struct nlmsghdr *nlh;	/* RXRING_MSG */
+};
+
+int rxring_start(struct nl_sock *sk, unsigned int slots);
+struct rxring_slot *rxring_peek(void);
+void rxring_release(void);
+void rxring_wait(int timeout);
+void rxring_stop(void);
+void rxring_stats(unsigned int *slots, unsigned int *hwm, unsigned long *full,
+		  unsigned long *large);
+
+/* uring.c */
+#define URING_RECV_BUFS_DEFAULT 8
+#define URING_OUTPUT_BUFS_DEFAULT 4
+
+int uring_start(int sock, unsigned int n_recv);
+void uring_stop(void);
+void uring_wait(int timeout);
+ssize_t uring_recv(uint8_t **buf, size_t *size, uint64_t *ts,
+		   uint64_t *mono);
+void uring_recv_done(void);
+int uring_write(int fd, const void *buf, size_t len);
+void uring_write_sync(void);
+
+/* stats.c */
+#define STATS_INTERVAL_DEFAULT 10
+
+enum stats_hist {
+	STATS_HIST_RECV_WRITE,	/* Message received to output written */
+	STATS_HIST_FLUSH_DELAY,	/* Time output waits in the output buffer */
+	STATS_HIST_SEND_ACK,	/* Request sent to ACK (or error) received */
+	STATS_HIST_MAX,
+};
+
+void stats_init(const char *path, unsigned int interval_s);
+void stats_rx(const struct nlmsghdr *nlh);
+void stats_filtered(unsigned int cmd);
+void stats_written(unsigned int cmd, size_t len);
+void stats_request(unsigned int cmd, int status);
+void stats_write(size_t len, uint64_t ns);
+void stats_latency(enum stats_hist h, uint64_t ns);
+int stats_timeout(void);
+void stats_poll(void);
+void stats_exit(void);
+
+/* transport.c */
+struct msghdr;
+
+/* Netlink I/O operations (see transport.c) */
+struct transport {
+	const char *name;
+	int (*connect)(struct nl_sock *sk);
+	int (*add_membership)(struct nl_sock *sk, int group);
+	int (*send)(struct nl_sock *sk, struct nl_msg *msg);
+	ssize_t (*recv)(struct nl_sock *sk, struct msghdr *msg, int flags);
+	int (*fd)(const struct nl_sock *sk);
+	void (*close)(struct nl_sock *sk);
+};
+
+void transport_set(const struct transport *t);
+const char *transport_name(void);
+int transport_connect(struct nl_sock *sk);
+void transport_close(struct nl_sock *sk);
+int transport_add_membership(struct nl_sock *sk, int group);
+int transport_send(struct nl_sock *sk, struct nl_msg *msg);
+ssize_t transport_recv(struct nl_sock *sk, struct msghdr *msg, int flags);
+int transport_fd(struct nl_sock *sk);
+int transport_set_nonblocking(struct nl_sock *sk);
+
+/* mock.c */
+#define MOCK_FAMILY_ID_DEFAULT 0x1c
+
+int mock_setup(const char *script, const char *capture, double speed);
+
+/* pcap.c */
+struct pcap;
+struct pcap_reader;
+
+struct pcap *pcap_open(const char *path, uint64_t rotate_size,
+		       unsigned int rotate_s);
+int pcap_write(struct pcap *p, const struct nlmsghdr *nlh, uint64_t ts_ns);
+int pcap_flush(struct pcap *p);
+void pcap_close(struct pcap *p);
+
+struct pcap_reader *pcap_reader_open(const char *path);
+int pcap_read(struct pcap_reader *r, const struct nlmsghdr **nlh,
+	      uint64_t *ts_ns);
+int pcap_rewind(struct pcap_reader *r);
+void pcap_reader_close(struct pcap_reader *r);
+
+/* flight.c */
+#define FLIGHT_SIZE_DEFAULT (4 * 1024 * 1024)
+#define FLIGHT_PATH_DEFAULT "/tmp/iwraw-flight"
+
+int flight_init(unsigned int max, size_t size, unsigned int window_s,
+		const char *path, const char *trigger);
+void flight_record(const struct nlmsghdr *nlh, uint64_t ts_ns,
+		   uint64_t mono_ns);
+int flight_dump(void);
+void flight_poll(void);
+
+/* daemon.c */
+int do_daemon(const char *path, int in_fd, int out_fd,
+	      const struct batch_events *events, const struct nlcmd *defaults,
+	      unsigned int window, unsigned int timeout_ms);
+
+#endif /*_IWRAW_H_*/
@@ -0,0 +1,783 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Mock nl80211 kernel.
+ *
+ * The mock transport replaces the netlink socket with one end of a Unix
+ * domain socket pair (SOCK_SEQPACKET, so that message boundaries are
+ * kept). A thread serving the other end plays the kernel: it answers
+ * requests and sends events as described by a script.
+ *
+ * Script syntax (one statement per line, # starts a comment):
+ *
+ *   family ID                    nl80211 family id
+ *   group NAME ID                Multicast group (default: config, scan,
+ *                                regulatory, mlme and vendor)
+ *   reply CMD [HEX]              Reply to CMD with a message carrying the
+ *                                attributes HEX. Several replies to the
+ *                                same command are sent in order (as a
+ *                                multipart message if a dump is requested)
+ *   error CMD ERRNO              Fail CMD with -ERRNO
+ *   delay CMD MS                 Answer CMD after MS milliseconds (the mock
+ *                                kernel is stalled meanwhile, like a
+ *                                wedged driver)
+ *   event CMD COUNT RATE [HEX]   Send COUNT CMD events carrying the
+ *                                attributes HEX, at most RATE per second
+ *                                (0 means as fast as possible)
+ *
+ * CMD is an nl80211 command name (see --print-commands) or number.
+ * Commands without a reply or error statement are acknowledged.
+ *
+ * The events are sent, in script order, by a separate thread when the
+ * first multicast group is joined (requests are answered meanwhile).
+ * A capture (see pcap.c) may be replayed after them. Unlike the kernel,
+ * the mock never drops events: it waits when the receive buffer is full.
+ * When all events have been sent, the mock kernel hangs up.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <netlink/msg.h>
+#include <netlink/attr.h>
+#include <netlink/genl/genl.h>
+#include <netlink/genl/ctrl.h>
+#include "iwraw.h"
+#include "log.h"
+
+#define MOCK_REPLIES_MAX 256
+#define MOCK_EVENTS_MAX 32
+#define MOCK_NLA_MAX_LEN 4096
+#define MOCK_BUF_SIZE (64 * 1024)
+#define MOCK_LINE_MAX (2 * MOCK_NLA_MAX_LEN + 256)
+
+struct mock_reply {
+	uint8_t cmd;
+	void *nla;
+	size_t nla_len;
+};
+
+struct mock_event {
+	uint8_t cmd;
+	unsigned long count;
+	double rate;
+	void *nla;
+	size_t nla_len;
+	/* The complete event message (built once) */
+	void *msg;
+	size_t msg_len;
+};
+
+struct mock {
+	struct genl_family_info info;
+	int errors[NL80211_CMD_MAX + 1];
+	unsigned int delays_ms[NL80211_CMD_MAX + 1];
+	struct mock_reply replies[MOCK_REPLIES_MAX];
+	unsigned int n_replies;
+	struct mock_event events[MOCK_EVENTS_MAX];
+	unsigned int n_events;
+	/* Capture replayed after the events (speed 0: as fast as possible) */
+	struct pcap_reader *capture;
+	double speed;
+	bool events_sent;
+	int kern_fd;		/* The kernel end of the socket pair */
+	int user_fd;		/* The iwraw end of the socket pair */
+	pthread_t thread;
+	pthread_t events_thread;
+};
+
+static const struct genl_mcgrp default_grps[] = {
+	{ "config", 5 },
+	{ "scan", 6 },
+	{ "regulatory", 7 },
+	{ "mlme", 8 },
+	{ "vendor", 9 },
+};
+
+static struct mock mock;
+
+static int parse_cmd(const char *str, uint8_t *cmd)
+{
+	unsigned long val;
+	char *end;
+
+	val = strtoul(str, &end, 0);
+	if (end == str || *end)
+		val = nl80211_cmd_from_str(str);
+	if (val <= NL80211_CMD_UNSPEC || val > NL80211_CMD_MAX)
+		return -EINVAL;
+	*cmd = val;
+
+	return 0;
+}
+
+/* Parse a stream of netlink attributes in hex (no separators) */
+static int parse_nla(const char *str, void **nla, size_t *nla_len)
+{
+	size_t i, len = strlen(str) / 2;
+	uint8_t *buf;
+
+	*nla = NULL;
+	*nla_len = 0;
+	if (!str[0])
+		return 0;
+	if (strlen(str) % 2 || len > MOCK_NLA_MAX_LEN)
+		return -EINVAL;
+
+	buf = malloc(len);
+	if (!buf)
+		return -ENOMEM;
+	for (i = 0; i < len; i++) {
+		unsigned int byte;
+
+		if (sscanf(str + 2 * i, "%2x", &byte) != 1) {
+			free(buf);
+			return -EINVAL;
+		}
+		buf[i] = byte;
+	}
+	if (validate_nla_stream(buf, len)) {
+		free(buf);
+		return -EINVAL;
+	}
+
+	*nla = buf;
+	*nla_len = len;
+
+	return 0;
+}
+
+static int parse_line(char *line)
+{
+	char *argv[7], *saveptr;
+	int argc = 0;
+
+	/* No statement takes more than 5 tokens, so a sixth is an error */
+	for (argv[0] = strtok_r(line, " \t\r\n", &saveptr); argv[argc];
+	     argv[argc] = strtok_r(NULL, " \t\r\n", &saveptr)) {
+		if (argv[argc][0] == '#' || ++argc == 6)
+			break;
+	}
+	argv[argc] = NULL;
+
+	if (!argc)
+		return 0;
+	if (argc == 6)
+		return -E2BIG;
+
+	if (!strcmp(argv[0], "family") && argc == 2) {
+		mock.info.id = strtol(argv[1], NULL, 0);
+		if (mock.info.id <= GENL_ID_CTRL || mock.info.id > 0xffff)
+			return -EINVAL;
+	} else if (!strcmp(argv[0], "group") && argc == 3) {
+		struct genl_mcgrp *grp;
+
+		if (mock.info.n_grps == GENL_MCGRP_MAX)
+			return -ENOSPC;
+		grp = &mock.info.grps[mock.info.n_grps++];
+		strncpy(grp->name, argv[1], sizeof(grp->name) - 1);
+		grp->id = strtoul(argv[2], NULL, 0);
+		if (!grp->id)
+			return -EINVAL;
+	} else if (!strcmp(argv[0], "reply") && (argc == 2 || argc == 3)) {
+		struct mock_reply *r;
+
+		if (mock.n_replies == MOCK_REPLIES_MAX)
+			return -ENOSPC;
+		r = &mock.replies[mock.n_replies];
+		if (parse_cmd(argv[1], &r->cmd) ||
+		    parse_nla(argc == 3 ? argv[2] : "", &r->nla, &r->nla_len))
+			return -EINVAL;
+		mock.n_replies++;
+	} else if (!strcmp(argv[0], "error") && argc == 3) {
+		uint8_t cmd;
+		int err = atoi(argv[2]);
+
+		if (parse_cmd(argv[1], &cmd) || err <= 0)
+			return -EINVAL;
+		mock.errors[cmd] = -err;
+	} else if (!strcmp(argv[0], "delay") && argc == 3) {
+		uint8_t cmd;
+
+		if (parse_cmd(argv[1], &cmd))
+			return -EINVAL;
+		mock.delays_ms[cmd] = strtoul(argv[2], NULL, 0);
+	} else if (!strcmp(argv[0], "event") && (argc == 4 || argc == 5)) {
+		struct mock_event *e;
+
+		if (mock.n_events == MOCK_EVENTS_MAX)
+			return -ENOSPC;
+		e = &mock.events[mock.n_events];
+		if (parse_cmd(argv[1], &e->cmd) ||
+		    parse_nla(argc == 5 ? argv[4] : "", &e->nla, &e->nla_len))
+			return -EINVAL;
+		e->count = strtoul(argv[2], NULL, 0);
+		e->rate = strtod(argv[3], NULL);
+		if (e->rate < 0)
+			return -EINVAL;
+		mock.n_events++;
+	} else {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int parse_script(const char *script)
+{
+	char line[MOCK_LINE_MAX];
+	unsigned int lineno = 0;
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(script, "r");
+	if (!f) {
+		ret = -errno;
+		LOG_ERR_("Unable to open mock script %s: %s\n", script,
+			 strerror(-ret));
+		return ret;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		ret = parse_line(line);
+		if (ret == -E2BIG) {
+			LOG_ERR_("%s:%u: too many arguments\n", script, lineno);
+			break;
+		} else if (ret) {
+			LOG_ERR_("%s:%u: invalid statement\n", script, lineno);
+			break;
+		}
+	}
+	fclose(f);
+
+	return ret;
+}
+
+/*
+ * Put a generic netlink message with the attributes nla into buf.
+ * Returns the length of the message.
+ */
+static size_t put_genlmsg(void *buf, uint16_t type, uint16_t flags,
+			  uint32_t seq, uint32_t pid, uint8_t cmd,
+			  const void *nla, size_t nla_len)
+{
+	struct nlmsghdr *nlh = buf;
+	struct genlmsghdr *gnlh = NLMSG_DATA(nlh);
+
+	nlh->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + nla_len);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = flags;
+	nlh->nlmsg_seq = seq;
+	nlh->nlmsg_pid = pid;
+	gnlh->cmd = cmd;
+	gnlh->version = 1;
+	gnlh->reserved = 0;
+	memcpy((uint8_t *) gnlh + GENL_HDRLEN, nla, nla_len);
+
+	return nlh->nlmsg_len;
+}
+
+static int kern_send(const void *buf, size_t len)
+{
+	ssize_t n;
+
+	do {
+		n = send(mock.kern_fd, buf, len, MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+
+	return n < 0 ? -errno : 0;
+}
+
+/* Send an error (or an ACK if error is 0) in response to req */
+static int kern_error(const struct nlmsghdr *req, int error)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct nlmsgerr err;
+	} msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.nlh.nlmsg_len = sizeof(msg);
+	msg.nlh.nlmsg_type = NLMSG_ERROR;
+	msg.nlh.nlmsg_seq = req->nlmsg_seq;
+	msg.nlh.nlmsg_pid = req->nlmsg_pid;
+	msg.err.error = error;
+	msg.err.msg = *req;
+
+	return kern_send(&msg, sizeof(msg));
+}
+
+static int kern_done(const struct nlmsghdr *req)
+{
+	struct {
+		struct nlmsghdr nlh;
+		int error;
+	} msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.nlh.nlmsg_len = sizeof(msg);
+	msg.nlh.nlmsg_type = NLMSG_DONE;
+	msg.nlh.nlmsg_flags = NLM_F_MULTI;
+	msg.nlh.nlmsg_seq = req->nlmsg_seq;
+	msg.nlh.nlmsg_pid = req->nlmsg_pid;
+
+	return kern_send(&msg, sizeof(msg));
+}
+
+/* CTRL_CMD_GETFAMILY. Only nl80211 exists. */
+static int kern_getfamily(const struct nlmsghdr *req)
+{
+	struct nlattr *name, *grps, *grp;
+	struct genlmsghdr *gnlh;
+	struct nlmsghdr *nlh;
+	struct nl_msg *msg;
+	int i, ret;
+
+	name = nlmsg_find_attr((struct nlmsghdr *) req, GENL_HDRLEN,
+			       CTRL_ATTR_FAMILY_NAME);
+	if (!name || nla_strcmp(name, "nl80211"))
+		return kern_error(req, -ENOENT);
+
+	msg = nlmsg_alloc();
+	if (!msg)
+		return kern_error(req, -ENOMEM);
+
+	nlh = nlmsg_put(msg, req->nlmsg_pid, req->nlmsg_seq, GENL_ID_CTRL,
+			GENL_HDRLEN, 0);
+	if (!nlh)
+		goto nla_put_failure;
+	gnlh = nlmsg_data(nlh);
+	gnlh->cmd = CTRL_CMD_NEWFAMILY;
+	gnlh->version = 2;
+
+	NLA_PUT_STRING(msg, CTRL_ATTR_FAMILY_NAME, "nl80211");
+	NLA_PUT_U16(msg, CTRL_ATTR_FAMILY_ID, mock.info.id);
+	grps = nla_nest_start(msg, CTRL_ATTR_MCAST_GROUPS);
+	if (!grps)
+		goto nla_put_failure;
+	for (i = 0; i < mock.info.n_grps; i++) {
+		grp = nla_nest_start(msg, i + 1);
+		if (!grp)
+			goto nla_put_failure;
+		NLA_PUT_STRING(msg, CTRL_ATTR_MCAST_GRP_NAME,
+			       mock.info.grps[i].name);
+		NLA_PUT_U32(msg, CTRL_ATTR_MCAST_GRP_ID, mock.info.grps[i].id);
+		nla_nest_end(msg, grp);
+	}
+	nla_nest_end(msg, grps);
+
+	ret = kern_send(nlh, nlh->nlmsg_len);
+	nlmsg_free(msg);
+	if (ret)
+		return ret;
+
+	return kern_error(req, 0);
+
+nla_put_failure:
+	nlmsg_free(msg);
+	return kern_error(req, -ENOBUFS);
+}
+
+/* Stall for ms milliseconds (or until iwraw hangs up) */
+static void kern_stall(unsigned int ms)
+{
+	struct pollfd pfd = { .fd = mock.kern_fd };
+
+	(void) poll(&pfd, 1, ms);
+}
+
+/* An nl80211 command */
+static int kern_command(const struct nlmsghdr *req)
+{
+	struct genlmsghdr *gnlh = NLMSG_DATA(req);
+	bool dump = (req->nlmsg_flags & NLM_F_DUMP) == NLM_F_DUMP;
+	uint8_t buf[NLMSG_HDRLEN + GENL_HDRLEN + MOCK_NLA_MAX_LEN];
+	unsigned int i;
+	int ret;
+
+	if (gnlh->cmd > NL80211_CMD_MAX)
+		return kern_error(req, -EOPNOTSUPP);
+	if (mock.delays_ms[gnlh->cmd])
+		kern_stall(mock.delays_ms[gnlh->cmd]);
+	if (mock.errors[gnlh->cmd])
+		return kern_error(req, mock.errors[gnlh->cmd]);
+
+	for (i = 0; i < mock.n_replies; i++) {
+		const struct mock_reply *r = &mock.replies[i];
+		size_t len;
+
+		if (r->cmd != gnlh->cmd)
+			continue;
+		len = put_genlmsg(buf, mock.info.id, dump ? NLM_F_MULTI : 0,
+				  req->nlmsg_seq, req->nlmsg_pid, r->cmd,
+				  r->nla, r->nla_len);
+		ret = kern_send(buf, len);
+		if (ret)
+			return ret;
+	}
+
+	if (dump)
+		return kern_done(req);
+	if (req->nlmsg_flags & NLM_F_ACK)
+		return kern_error(req, 0);
+
+	return 0;
+}
+
+static uint64_t kern_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Sleep until the (monotonic) time due, if it hasn't passed already */
+static void kern_wait(uint64_t due)
+{
+	uint64_t now = kern_now();
+	struct timespec ts;
+
+	if (due <= now)
+		return;
+
+	ts.tv_sec = (due - now) / 1000000000ULL;
+	ts.tv_nsec = (due - now) % 1000000000ULL;
+	nanosleep(&ts, NULL);
+}
+
+/* Send the messages of the capture, paced by their timestamps */
+static int kern_replay(void)
+{
+	const struct nlmsghdr *nlh;
+	uint64_t start = kern_now(), first_ts = 0, ts;
+	int ret;
+
+	while ((ret = pcap_read(mock.capture, &nlh, &ts)) > 0) {
+		if (!first_ts)
+			first_ts = ts;
+		if (mock.speed > 0 && ts > first_ts)
+			kern_wait(start + (ts - first_ts) / mock.speed);
+		ret = kern_send(nlh, nlh->nlmsg_len);
+		if (ret)
+			return ret;
+	}
+
+	if (ret)
+		LOG_ERR_("Mock kernel: unable to read capture: %s\n",
+			 strerror(-ret));
+
+	return ret;
+}
+
+/* Send all events of the script (and the capture) and hang up */
+static void *kern_events(void *arg)
+{
+	uint64_t next, interval_ns;
+	unsigned int i;
+	unsigned long n;
+
+	(void) arg;
+
+	for (i = 0; i < mock.n_events; i++) {
+		const struct mock_event *e = &mock.events[i];
+
+		interval_ns = e->rate > 0 ? 1000000000.0 / e->rate : 0;
+		next = kern_now();
+		for (n = 0; n < e->count; n++) {
+			if (interval_ns) {
+				kern_wait(next);
+				next += interval_ns;
+			}
+			if (kern_send(e->msg, e->msg_len))
+				return NULL;
+		}
+	}
+
+	if (mock.capture && kern_replay())
+		return NULL;
+
+	LOG_INFO_("Mock kernel: all events sent\n");
+	shutdown(mock.kern_fd, SHUT_RDWR);
+
+	return NULL;
+}
+
+static void kern_request(const struct nlmsghdr *nlh)
+{
+	struct genlmsghdr *gnlh = NLMSG_DATA(nlh);
+
+	/* A multicast group has been joined (see mock_add_membership()) */
+	if (nlh->nlmsg_type == NLMSG_NOOP) {
+		if (!mock.events_sent && (mock.n_events || mock.capture) &&
+		    !pthread_create(&mock.events_thread, NULL, kern_events,
+				    NULL))
+			mock.events_sent = true;
+		return;
+	}
+
+	if (nlh->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN)) {
+		(void) kern_error(nlh, -EINVAL);
+	} else if (nlh->nlmsg_type == GENL_ID_CTRL) {
+		if (gnlh->cmd == CTRL_CMD_GETFAMILY)
+			(void) kern_getfamily(nlh);
+		else
+			(void) kern_error(nlh, -EOPNOTSUPP);
+	} else if (nlh->nlmsg_type == mock.info.id) {
+		(void) kern_command(nlh);
+	} else {
+		(void) kern_error(nlh, -ENOENT);
+	}
+}
+
+static void *kern_thread(void *arg)
+{
+	uint8_t *buf = malloc(MOCK_BUF_SIZE);
+	struct nlmsghdr *nlh;
+	ssize_t n;
+	int len;
+
+	(void) arg;
+	if (!buf) {
+		shutdown(mock.kern_fd, SHUT_RDWR);
+		return NULL;
+	}
+
+	for (;;) {
+		n = recv(mock.kern_fd, buf, MOCK_BUF_SIZE, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		len = n;
+		for (nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len))
+			kern_request(nlh);
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+static int mock_connect(struct nl_sock *sk)
+{
+	int fds[2], ret;
+
+	(void) sk;
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds))
+		return -nl_syserr2nlerr(errno);
+	mock.kern_fd = fds[0];
+	mock.user_fd = fds[1];
+
+	ret = pthread_create(&mock.thread, NULL, kern_thread, NULL);
+	if (ret) {
+		close(fds[0]);
+		close(fds[1]);
+		return -nl_syserr2nlerr(ret);
+	}
+
+	return 0;
+}
+
+/* Stop the mock kernel and forget the script (mock_setup() may be called
+ * again)
+ */
+static void mock_close(struct nl_sock *sk)
+{
+	unsigned int i;
+
+	(void) sk;
+	shutdown(mock.user_fd, SHUT_RDWR);
+	pthread_join(mock.thread, NULL);
+	if (mock.events_sent)
+		pthread_join(mock.events_thread, NULL);
+	close(mock.kern_fd);
+	close(mock.user_fd);
+
+	for (i = 0; i < mock.n_replies; i++)
+		free(mock.replies[i].nla);
+	for (i = 0; i < mock.n_events; i++) {
+		free(mock.events[i].nla);
+		free(mock.events[i].msg);
+	}
+	pcap_reader_close(mock.capture);
+	memset(&mock, 0, sizeof(mock));
+}
+
+/* The join is signalled in-band with an NLMSG_NOOP message */
+static int mock_add_membership(struct nl_sock *sk, int group)
+{
+	struct nlmsghdr nlh = {
+		.nlmsg_len = NLMSG_HDRLEN,
+		.nlmsg_type = NLMSG_NOOP,
+		.nlmsg_seq = group,
+	};
+	int i;
+
+	(void) sk;
+	for (i = 0; i < mock.info.n_grps; i++) {
+		if (mock.info.grps[i].id == (uint32_t) group)
+			break;
+	}
+	if (i == mock.info.n_grps)
+		return -NLE_INVAL;
+
+	/* The mock kernel may already have sent all events and hung up
+	 * (after the first join)
+	 */
+	if (send(mock.user_fd, &nlh, sizeof(nlh), MSG_NOSIGNAL) < 0 &&
+	    errno != EPIPE)
+		return -nl_syserr2nlerr(errno);
+
+	return 0;
+}
+
+static int mock_send(struct nl_sock *sk, struct nl_msg *msg)
+{
+	struct nlmsghdr *nlh = nlmsg_hdr(msg);
+	ssize_t n;
+
+	nl_complete_msg(sk, msg);
+	n = send(mock.user_fd, nlh, nlh->nlmsg_len, MSG_NOSIGNAL);
+	if (n < 0)
+		return -nl_syserr2nlerr(errno);
+
+	return n;
+}
+
+/* Messages appear to come from the kernel (port 0) */
+static ssize_t mock_recv(struct nl_sock *sk, struct msghdr *msg, int flags)
+{
+	struct sockaddr_nl *nla = msg->msg_name;
+	socklen_t namelen = msg->msg_namelen;
+	ssize_t n;
+
+	(void) sk;
+	msg->msg_name = NULL;
+	msg->msg_namelen = 0;
+	n = recvmsg(mock.user_fd, msg, flags);
+	msg->msg_name = nla;
+	if (n >= 0 && nla && namelen >= sizeof(*nla)) {
+		memset(nla, 0, sizeof(*nla));
+		nla->nl_family = AF_NETLINK;
+		msg->msg_namelen = sizeof(*nla);
+	}
+
+	return n;
+}
+
+static int mock_fd(const struct nl_sock *sk)
+{
+	(void) sk;
+
+	return mock.user_fd;
+}
+
+static const struct transport mock_transport = {
+	.name = "mock",
+	.connect = mock_connect,
+	.add_membership = mock_add_membership,
+	.send = mock_send,
+	.recv = mock_recv,
+	.fd = mock_fd,
+	.close = mock_close,
+};
+
+/*
+ * Use the family id of the first message of the capture, so that the
+ * messages are recognized as nl80211 messages.
+ */
+static int capture_family(void)
+{
+	const struct nlmsghdr *nlh;
+	uint64_t ts;
+	int ret;
+
+	ret = pcap_read(mock.capture, &nlh, &ts);
+	if (ret < 0)
+		return ret;
+	if (ret && nlh->nlmsg_type > GENL_ID_CTRL)
+		mock.info.id = nlh->nlmsg_type;
+
+	return pcap_rewind(mock.capture);
+}
+
+/*
+ * Read the mock kernel script (if any) and use the mock transport.
+ * If capture is given, the messages of the capture are replayed after
+ * the events of the script, speed times faster than they were captured
+ * (as fast as possible if speed is 0).
+ */
+int mock_setup(const char *script, const char *capture, double speed)
+{
+	uint8_t buf[NLMSG_HDRLEN + GENL_HDRLEN + MOCK_NLA_MAX_LEN];
+	unsigned int i;
+	int ret;
+
+	mock.info.id = MOCK_FAMILY_ID_DEFAULT;
+	if (script) {
+		ret = parse_script(script);
+		if (ret)
+			return ret;
+		LOG_NOTICE_("Using mock kernel script %s\n", script);
+	}
+
+	if (capture) {
+		mock.capture = pcap_reader_open(capture);
+		if (!mock.capture)
+			return -EINVAL;
+		mock.speed = speed;
+		ret = capture_family();
+		if (ret)
+			return ret;
+		LOG_NOTICE_("Replaying %s\n", capture);
+	}
+
+	if (!mock.info.n_grps) {
+		mock.info.n_grps = sizeof(default_grps) /
+				   sizeof(default_grps[0]);
+		memcpy(mock.info.grps, default_grps, sizeof(default_grps));
+	}
+
+	for (i = 0; i < mock.n_events; i++) {
+		struct mock_event *e = &mock.events[i];
+
+		e->msg_len = put_genlmsg(buf, mock.info.id, 0, 0, 0, e->cmd,
+					 e->nla, e->nla_len);
+		e->msg = malloc(e->msg_len);
+		if (!e->msg)
+			return -ENOMEM;
+		memcpy(e->msg, buf, e->msg_len);
+	}
+
+	transport_set(&mock_transport);
+
+	return 0;
+}
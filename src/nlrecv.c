@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Receive function used instead of the libnl default (nl_recv()).
+ *
+ * Each datagram is received with a single recvmsg() into a buffer that is
+ * large enough for any nl80211 message (libnl peeks at every datagram
+ * first in order to find out its size, which costs an extra syscall).
+ *
+ * The receive time of each datagram is recorded, so that all records
+ * created from its messages carry the time the message was read from the
+ * socket rather than the time the record was written.
+ * Netlink sockets don't support SO_TIMESTAMP(NS), so the time is taken
+ * immediately after recvmsg() returns. The time is per thread, since
+ * messages received by the receive thread (see rxring.c) are handled by
+ * the main thread.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <netlink/errno.h>
+#include "iwraw.h"
+#include "log.h"
+
+/* Initial size of the receive buffer (grown if a datagram is truncated) */
+#define NLRECV_BUF_SIZE (64 * 1024)
+
+static size_t buf_size = NLRECV_BUF_SIZE;
+static __thread uint64_t rx_timestamp, rx_monotonic;
+
+static int nlrecv(struct nl_sock *sk, struct sockaddr_nl *nla,
+		  unsigned char **buf, struct ucred **creds)
+{
+	struct iovec iov;
+	struct msghdr msg = {
+		.msg_name = nla,
+		.msg_namelen = sizeof(*nla),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	ssize_t n;
+
+	/* libnl frees the buffer after the messages have been handled.
+	 * A buffer of the same size is then normally reused by malloc.
+	 */
+	iov.iov_len = buf_size;
+	iov.iov_base = malloc(iov.iov_len);
+	if (!iov.iov_base)
+		return -NLE_NOMEM;
+
+	do {
+		n = transport_recv(sk, &msg, MSG_TRUNC);
+	} while (n < 0 && errno == EINTR);
+
+	if (n <= 0) {
+		int err = n ? -nl_syserr2nlerr(errno) : 0;
+
+		free(iov.iov_base);
+		return err;
+	}
+
+	rx_timestamp = timestamp_ns();
+	rx_monotonic = monotonic_ns();
+
+	if (msg.msg_flags & MSG_TRUNC) {
+		/* n is the real length of the datagram */
+		LOG_ERR_("Netlink message truncated (%zd bytes). Message lost\n",
+			 n);
+		buf_size = n;
+		free(iov.iov_base);
+		return -NLE_MSG_TRUNC;
+	}
+
+	if (msg.msg_namelen != sizeof(*nla)) {
+		free(iov.iov_base);
+		return -NLE_NOADDR;
+	}
+
+	*buf = iov.iov_base;
+	if (creds)
+		*creds = NULL;
+
+	return n;
+}
+
+/* Use nlrecv() for all messages received with cb */
+void nlrecv_setup(struct nl_cb *cb)
+{
+	nl_cb_overwrite_recv(cb, nlrecv);
+}
+
+/* Receive time (ns since the epoch) of the last received datagram */
+uint64_t nlrecv_timestamp(void)
+{
+	return rx_timestamp;
+}
+
+/* Receive time (monotonic_ns()) of the last received datagram */
+uint64_t nlrecv_monotonic(void)
+{
+	return rx_monotonic;
+}
+
+/*
+ * Set the receive time (ts since the epoch and mono from monotonic_ns())
+ * of the message about to be handled (by a thread other than the one
+ * that received it)
+ */
+void nlrecv_set_timestamp(uint64_t ts, uint64_t mono)
+{
+	rx_timestamp = ts;
+	rx_monotonic = mono;
+}
@@ -0,0 +1,447 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Output records (see record.h) and the buffered output layer used for
+ * received messages.
+ *
+ * The buffered output coalesces the output of many messages into few
+ * large writes. The buffer is flushed when it is full, when the oldest
+ * buffered data has waited for flush_ms milliseconds, or (if
+ * flush_idle is set) as soon as there is nothing more to receive.
+ *
+ * With io_uring (see uring.c), full buffers are written asynchronously
+ * while the output continues in a spare buffer. Anything written
+ * synchronously waits for the asynchronous writes first, so the order of
+ * the output is kept.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <netlink/msg.h>
+#include <netlink/attr.h>
+#include <netlink/genl/genl.h>
+#include "iwraw.h"
+#include "hex.h"
+
+struct output {
+	int fd;
+	uint8_t *buf;
+	size_t len;
+	size_t size;		/* 0 means unbuffered */
+	unsigned int flush_ms;	/* 0 means no time based flush */
+	bool flush_idle;
+	uint64_t first_ns;	/* monotonic_ns() of the oldest buffered data */
+	/* Used for hex encoded output that doesn't fit in the buffer */
+	char *scratch;
+	size_t scratch_size;
+	/* Asynchronous writes (see output_set_async()) */
+	bool async;
+	uint8_t *spare[OUTPUT_ASYNC_BUFS_MAX];
+	unsigned int n_spare;
+	int async_err;		/* Error of an earlier asynchronous write */
+};
+
+static struct output out = {
+	.fd = 1,
+};
+
+int write_full(int fd, const void *buf, size_t len)
+{
+	size_t n = 0;
+
+	while (n < len) {
+		ssize_t write_len;
+
+		write_len = write(fd, (const uint8_t *) buf + n, len - n);
+		if (write_len < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		n += write_len;
+	}
+
+	return 0;
+}
+
+/* writev() that handles partial writes. iov is modified. */
+static int writev_full(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt) {
+		ssize_t n;
+
+		n = writev(fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		while (iovcnt && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (uint8_t *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+int write_record(int fd, const struct iwraw_rec_hdr *hdr,
+		 const void *data, size_t data_len)
+{
+	int ret;
+
+	ret = write_full(fd, hdr, sizeof(*hdr));
+	if (ret)
+		return ret;
+
+	return data_len ? write_full(fd, data, data_len) : 0;
+}
+
+/* Wall clock time (for the timestamps of records and captures) */
+uint64_t timestamp_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Time for timers and intervals (not affected by clock steps) */
+uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Value of a top level u32 attribute of a generic netlink message */
+uint32_t genlmsg_get_u32(const struct nlmsghdr *nlh, int attrtype)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlh);
+	struct nlattr *attr;
+	int rem;
+
+	nla_for_each_attr(attr, genlmsg_attrdata(gnlh, 0),
+			  genlmsg_attrlen(gnlh, 0), rem) {
+		if (nla_type(attr) == attrtype &&
+		    nla_len(attr) >= (int) sizeof(uint32_t))
+			return nla_get_u32(attr);
+	}
+
+	return 0;
+}
+
+/*
+ * Initialize a record header for a record of type type.
+ * If nlh is given, the header will describe that message, and len will
+ * include the attributes of the message. The timestamp is then the
+ * receive time of the message.
+ */
+void record_init(struct iwraw_rec_hdr *hdr, uint16_t type,
+		 const struct nlmsghdr *nlh, uint32_t seq)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->len = sizeof(*hdr);
+	hdr->type = type;
+	hdr->seq = seq;
+
+	if (nlh) {
+		struct genlmsghdr *gnlh = nlmsg_data(nlh);
+
+		hdr->timestamp = nlrecv_timestamp();
+		hdr->len += genlmsg_attrlen(gnlh, 0);
+		hdr->cmd = gnlh->cmd;
+		hdr->ifindex = genlmsg_get_u32(nlh, NL80211_ATTR_IFINDEX);
+	}
+	if (!hdr->timestamp)
+		hdr->timestamp = timestamp_ns();
+}
+
+/*
+ * Set up the buffered output. size is the size of the output buffer
+ * (0 disables buffering).
+ */
+int output_init(int fd, size_t size, unsigned int flush_ms, bool flush_idle)
+{
+	out.fd = fd;
+	out.len = 0;
+	out.size = size;
+	out.flush_ms = flush_ms;
+	out.flush_idle = flush_idle;
+
+	free(out.buf);
+	out.buf = NULL;
+	if (!size)
+		return 0;
+
+	out.buf = malloc(size);
+	if (!out.buf) {
+		out.size = 0;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Write the output buffer asynchronously (see uring.c) using n_bufs
+ * buffers in total, or synchronously again if n_bufs is 0.
+ */
+int output_set_async(unsigned int n_bufs)
+{
+	if (out.async) {
+		uring_write_sync();
+		while (out.n_spare)
+			free(out.spare[--out.n_spare]);
+		out.async = false;
+	}
+
+	if (!n_bufs)
+		return 0;
+	if (!out.size || n_bufs < 2 || n_bufs > OUTPUT_ASYNC_BUFS_MAX + 1)
+		return -EINVAL;
+
+	while (out.n_spare < n_bufs - 1) {
+		uint8_t *buf = malloc(out.size);
+
+		if (!buf) {
+			while (out.n_spare)
+				free(out.spare[--out.n_spare]);
+			return -ENOMEM;
+		}
+		out.spare[out.n_spare++] = buf;
+	}
+	out.async = true;
+
+	return 0;
+}
+
+/* An asynchronous write of len bytes from buf has completed */
+void output_write_done(const void *buf, size_t len, int err, uint64_t ns)
+{
+	stats_write(len, ns);
+	if (err && !out.async_err)
+		out.async_err = err;
+	out.spare[out.n_spare++] = (uint8_t *) buf;
+}
+
+/* Hand the buffer over to the asynchronous writer and take a spare one */
+static int output_submit(void)
+{
+	int ret;
+
+	(void) uring_write(out.fd, out.buf, out.len);
+	out.len = 0;
+	while (!out.n_spare)
+		uring_wait(-1);
+	out.buf = out.spare[--out.n_spare];
+
+	ret = out.async_err;
+	out.async_err = 0;
+
+	return ret;
+}
+
+/* write_full() with statistics */
+static int output_write_full(const void *buf, size_t len)
+{
+	uint64_t start;
+	int ret;
+
+	if (out.async)
+		uring_write_sync();
+	start = monotonic_ns();
+	ret = write_full(out.fd, buf, len);
+	stats_write(len, monotonic_ns() - start);
+
+	return ret;
+}
+
+int output_flush(void)
+{
+	int ret;
+
+	if (!out.len)
+		return 0;
+
+	stats_latency(STATS_HIST_FLUSH_DELAY, monotonic_ns() - out.first_ns);
+	if (out.async)
+		return output_submit();
+	ret = output_write_full(out.buf, out.len);
+	out.len = 0;
+
+	return ret;
+}
+
+/* Flush the buffer if the oldest data has waited long enough */
+static int output_flush_expired(uint64_t now)
+{
+	if (out.len && out.flush_ms &&
+	    now - out.first_ns >= (uint64_t) out.flush_ms * 1000000)
+		return output_flush();
+
+	return 0;
+}
+
+/* len bytes have been added to the buffer */
+static int output_commit(size_t len)
+{
+	uint64_t now = 0;
+
+	if (!out.len)
+		out.first_ns = now = monotonic_ns();
+	else if (out.flush_ms)
+		now = monotonic_ns();
+	out.len += len;
+
+	if (out.len == out.size)
+		return output_flush();
+
+	return output_flush_expired(now);
+}
+
+/*
+ * Write (or buffer) a message consisting of a header and data (both
+ * are optional).
+ */
+int output_write(const void *hdr, size_t hdr_len, const void *data,
+		 size_t data_len)
+{
+	size_t len = hdr_len + data_len;
+	int err = 0, ret;
+
+	/* Continue in a spare buffer */
+	if (out.async && out.len + len > out.size && len <= out.size)
+		err = output_flush();
+
+	if (out.len + len > out.size) {
+		/* Doesn't fit. Write the buffer and the message with one
+		 * syscall.
+		 */
+		struct iovec iov[3];
+		int iovcnt = 0;
+		uint64_t start;
+
+		if (out.len) {
+			iov[iovcnt].iov_base = out.buf;
+			iov[iovcnt++].iov_len = out.len;
+		}
+		if (hdr_len) {
+			iov[iovcnt].iov_base = (void *) hdr;
+			iov[iovcnt++].iov_len = hdr_len;
+		}
+		if (data_len) {
+			iov[iovcnt].iov_base = (void *) data;
+			iov[iovcnt++].iov_len = data_len;
+		}
+		if (out.len)
+			stats_latency(STATS_HIST_FLUSH_DELAY,
+				      monotonic_ns() - out.first_ns);
+		len += out.len;
+		out.len = 0;
+
+		if (out.async)
+			uring_write_sync();
+		start = monotonic_ns();
+		ret = writev_full(out.fd, iov, iovcnt);
+		stats_write(len, monotonic_ns() - start);
+
+		return ret;
+	}
+
+	if (hdr_len)
+		memcpy(out.buf + out.len, hdr, hdr_len);
+	if (data_len)
+		memcpy(out.buf + out.len + hdr_len, data, data_len);
+
+	ret = output_commit(len);
+
+	return err ? err : ret;
+}
+
+/*
+ * Write data hex encoded (see hex_encode()). The data is encoded
+ * directly into the output buffer when possible.
+ */
+int output_write_hex(const uint8_t *data, size_t len)
+{
+	size_t enc_len = HEX_ENCODED_LEN(len);
+	int ret;
+
+	if (out.len + enc_len <= out.size)
+		return output_commit(hex_encode((char *) out.buf + out.len,
+						data, len));
+
+	ret = output_flush();
+	if (ret)
+		return ret;
+	if (enc_len <= out.size)
+		return output_commit(hex_encode((char *) out.buf, data, len));
+
+	if (enc_len > out.scratch_size) {
+		char *scratch = realloc(out.scratch, enc_len);
+
+		if (!scratch)
+			return -ENOMEM;
+		out.scratch = scratch;
+		out.scratch_size = enc_len;
+	}
+
+	return output_write_full(out.scratch,
+				 hex_encode(out.scratch, data, len));
+}
+
+/*
+ * Called when there is nothing more to receive (i.e. a read would block).
+ * Returns the poll timeout (in ms) to use while waiting for more data.
+ */
+int output_idle(void)
+{
+	uint64_t elapsed;
+
+	if (out.flush_idle)
+		(void) output_flush();
+
+	if (!out.len)
+		return -1;
+	if (!out.flush_ms)
+		return -1;
+
+	elapsed = (monotonic_ns() - out.first_ns) / 1000000;
+	if (elapsed >= out.flush_ms) {
+		(void) output_flush();
+		return -1;
+	}
+
+	return out.flush_ms - elapsed;
+}
@@ -0,0 +1,344 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * pcap capture of netlink messages.
+ *
+ * The capture uses LINKTYPE_NETLINK (the format of nlmon captures), so it
+ * can be opened directly in Wireshark. Each packet is one complete
+ * netlink message (nlmsghdr, genlmsghdr and attributes, in host byte
+ * order) preceded by a 16 byte pseudo header (big endian). Timestamps
+ * have nanosecond resolution.
+ *
+ * The capture can be rotated when it reaches a size or an age. The
+ * files are then named FILE, FILE1, FILE2 and so on (like tcpdump -C).
+ *
+ * Captures are read back by the mock kernel (--replay).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+
+#include "iwraw.h"
+#include "log.h"
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_VERSION_MAJOR 2
+#define PCAP_VERSION_MINOR 4
+#define PCAP_SNAPLEN (256 * 1024)
+#define PCAP_LINKTYPE_NETLINK 253
+#define PCAP_ARPHRD_NETLINK 824
+/* Packet sent by the kernel (see netlink_deliver_tap() in the kernel) */
+#define PCAP_PACKET_KERNEL 7
+#define PCAP_BUF_SIZE (64 * 1024)
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_nsec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+/* LINKTYPE_NETLINK pseudo header (big endian) */
+struct pcap_nl_hdr {
+	uint16_t pkttype;
+	uint16_t hatype;
+	uint16_t halen;
+	uint8_t addr[8];
+	uint16_t protocol;
+};
+
+struct pcap {
+	const char *path;
+	uint64_t rotate_size;
+	uint64_t rotate_ns;
+	unsigned int n_files;
+	int fd;
+	/* Bytes written to the current file (including the buffer) */
+	uint64_t size;
+	/* Timestamp of the first packet in the current file */
+	uint64_t first_ns;
+	size_t len;
+	uint8_t buf[PCAP_BUF_SIZE];
+};
+
+int pcap_flush(struct pcap *p)
+{
+	int ret;
+
+	if (!p->len)
+		return 0;
+
+	ret = write_full(p->fd, p->buf, p->len);
+	p->len = 0;
+	if (ret)
+		LOG_ERR_("Unable to write capture: %s\n", strerror(-ret));
+
+	return ret;
+}
+
+static int pcap_put(struct pcap *p, const void *data, size_t len)
+{
+	int ret;
+
+	if (p->len + len > sizeof(p->buf)) {
+		ret = pcap_flush(p);
+		if (ret)
+			return ret;
+	}
+
+	p->size += len;
+	if (len > sizeof(p->buf))
+		return write_full(p->fd, data, len);
+
+	memcpy(p->buf + p->len, data, len);
+	p->len += len;
+
+	return 0;
+}
+
+/* Open the next capture file and write the file header */
+static int pcap_open_file(struct pcap *p)
+{
+	struct pcap_file_hdr hdr = {
+		.magic = PCAP_MAGIC_NS,
+		.version_major = PCAP_VERSION_MAJOR,
+		.version_minor = PCAP_VERSION_MINOR,
+		.snaplen = PCAP_SNAPLEN,
+		.linktype = PCAP_LINKTYPE_NETLINK,
+	};
+	char path[PATH_MAX];
+
+	if (p->n_files)
+		snprintf(path, sizeof(path), "%s%u", p->path, p->n_files);
+	else
+		snprintf(path, sizeof(path), "%s", p->path);
+
+	p->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (p->fd < 0) {
+		int err = -errno;
+
+		LOG_ERR_("Unable to open capture file %s: %s\n", path,
+			 strerror(-err));
+		return err;
+	}
+	LOG_INFO_("Writing capture to %s\n", path);
+
+	p->n_files++;
+	p->size = 0;
+	p->first_ns = 0;
+
+	return pcap_put(p, &hdr, sizeof(hdr));
+}
+
+static void pcap_close_file(struct pcap *p)
+{
+	(void) pcap_flush(p);
+	close(p->fd);
+}
+
+/*
+ * Start a capture to path. The capture is rotated when rotate_size bytes
+ * have been written or when the first packet is rotate_s seconds old
+ * (0 disables rotation).
+ */
+struct pcap *pcap_open(const char *path, uint64_t rotate_size,
+		       unsigned int rotate_s)
+{
+	struct pcap *p;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+
+	p->path = path;
+	p->rotate_size = rotate_size;
+	p->rotate_ns = rotate_s * 1000000000ULL;
+
+	if (pcap_open_file(p)) {
+		free(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+/* Write the netlink message nlh (received at ts_ns) to the capture */
+int pcap_write(struct pcap *p, const struct nlmsghdr *nlh, uint64_t ts_ns)
+{
+	struct pcap_nl_hdr nl_hdr = {
+		.pkttype = htons(PCAP_PACKET_KERNEL),
+		.hatype = htons(PCAP_ARPHRD_NETLINK),
+		.protocol = htons(NETLINK_GENERIC),
+	};
+	struct pcap_rec_hdr rec;
+	size_t len = sizeof(nl_hdr) + nlh->nlmsg_len;
+	int ret;
+
+	rec.ts_sec = ts_ns / 1000000000ULL;
+	rec.ts_nsec = ts_ns % 1000000000ULL;
+	rec.orig_len = len;
+	rec.incl_len = len < PCAP_SNAPLEN ? len : PCAP_SNAPLEN;
+
+	if (p->first_ns &&
+	    ((p->rotate_size &&
+	      p->size + sizeof(rec) + rec.incl_len > p->rotate_size) ||
+	     (p->rotate_ns && ts_ns - p->first_ns >= p->rotate_ns))) {
+		pcap_close_file(p);
+		ret = pcap_open_file(p);
+		if (ret)
+			return ret;
+	}
+	if (!p->first_ns)
+		p->first_ns = ts_ns;
+
+	ret = pcap_put(p, &rec, sizeof(rec));
+	if (!ret)
+		ret = pcap_put(p, &nl_hdr, sizeof(nl_hdr));
+	if (!ret)
+		ret = pcap_put(p, nlh, rec.incl_len - sizeof(nl_hdr));
+
+	return ret;
+}
+
+void pcap_close(struct pcap *p)
+{
+	if (!p)
+		return;
+
+	pcap_close_file(p);
+	free(p);
+}
+
+struct pcap_reader {
+	FILE *f;
+	bool ns;		/* Nanosecond timestamps */
+	uint8_t buf[PCAP_SNAPLEN];
+};
+
+/* Open a capture written by pcap_open() (or nlmon) for reading */
+struct pcap_reader *pcap_reader_open(const char *path)
+{
+	struct pcap_file_hdr hdr;
+	struct pcap_reader *r;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	r->f = fopen(path, "r");
+	if (!r->f) {
+		LOG_ERR_("Unable to open capture file %s: %s\n", path,
+			 strerror(errno));
+		free(r);
+		return NULL;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, r->f) != 1 ||
+	    (hdr.magic != PCAP_MAGIC_NS && hdr.magic != PCAP_MAGIC_US) ||
+	    hdr.linktype != PCAP_LINKTYPE_NETLINK) {
+		/* Captures from hosts of the other byte order are not
+		 * supported (the netlink messages are in host byte order
+		 * anyway)
+		 */
+		LOG_ERR_("%s is not a netlink capture\n", path);
+		pcap_reader_close(r);
+		return NULL;
+	}
+	r->ns = hdr.magic == PCAP_MAGIC_NS;
+
+	return r;
+}
+
+/*
+ * Read the next generic netlink message of the capture. *nlh is valid
+ * until the next call.
+ * Returns 1 if a message was read, 0 at the end of the capture and a
+ * negative value on error. Truncated packets and packets of other
+ * netlink protocols are skipped.
+ */
+int pcap_read(struct pcap_reader *r, const struct nlmsghdr **nlh,
+	      uint64_t *ts_ns)
+{
+	const struct pcap_nl_hdr *nl_hdr;
+	struct pcap_rec_hdr rec;
+	size_t len;
+
+	for (;;) {
+		if (fread(&rec, sizeof(rec), 1, r->f) != 1)
+			return ferror(r->f) ? -EIO : 0;
+		if (rec.incl_len > sizeof(r->buf))
+			return -EINVAL;
+		if (fread(r->buf, rec.incl_len, 1, r->f) != 1)
+			return ferror(r->f) ? -EIO : 0;
+
+		if (rec.incl_len != rec.orig_len ||
+		    rec.incl_len < sizeof(*nl_hdr) + NLMSG_HDRLEN)
+			continue;
+		nl_hdr = (const struct pcap_nl_hdr *) r->buf;
+		if (nl_hdr->protocol != htons(NETLINK_GENERIC))
+			continue;
+
+		len = rec.incl_len - sizeof(*nl_hdr);
+		*nlh = (const struct nlmsghdr *) (r->buf + sizeof(*nl_hdr));
+		if ((*nlh)->nlmsg_len < NLMSG_HDRLEN ||
+		    (*nlh)->nlmsg_len > len)
+			continue;
+
+		*ts_ns = rec.ts_sec * 1000000000ULL +
+			 (r->ns ? rec.ts_nsec : rec.ts_nsec * 1000ULL);
+
+		return 1;
+	}
+}
+
+/* Go back to the first packet */
+int pcap_rewind(struct pcap_reader *r)
+{
+	if (fseek(r->f, sizeof(struct pcap_file_hdr), SEEK_SET))
+		return -errno;
+
+	return 0;
+}
+
+void pcap_reader_close(struct pcap_reader *r)
+{
+	if (!r)
+		return;
+
+	fclose(r->f);
+	free(r);
+}
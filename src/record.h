@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Wire format of the framed records read and written by iwraw.
+ *
+ * All fields are in host byte order (just like netlink itself).
+ * The len field of each header covers the header and the payload
+ * following it.
+ */
+
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <stdint.h>
+
+/* Request flags */
+#define IWRAW_REQ_F_IFINDEX	0x0001 /* Add devidx as NL80211_ATTR_IFINDEX */
+#define IWRAW_REQ_F_WIPHY	0x0002 /* Add devidx as NL80211_ATTR_WIPHY */
+
+/*
+ * Batch request record. The header is followed by an nla stream
+ * (len - sizeof(struct iwraw_req_hdr) bytes) that is appended to the
+ * nl80211 message.
+ */
+struct iwraw_req_hdr {
+	uint32_t len;
+	uint16_t cmd;
+	uint16_t flags;
+	uint32_t devidx;
+};
+
+/* Record types */
+enum iwraw_rec_type {
+	IWRAW_REC_REPLY = 1,	/* Attributes of a reply message */
+	IWRAW_REC_STATUS,	/* Final status of a request (no payload) */
+	IWRAW_REC_EVENT,	/* Attributes of an event message */
+	IWRAW_REC_GAP,		/* Messages were lost (struct iwraw_rec_gap) */
+};
+
+/*
+ * Output record. The header is followed by the netlink attributes of
+ * the message (if any).
+ *
+ * seq is the (zero based) index of the request that produced the record
+ * (batch and daemon mode) or the index of the record in the output
+ * stream (listen and send mode).
+ * status is 0 or a negative errno value (IWRAW_REC_STATUS and
+ * IWRAW_REC_GAP only).
+ * ifindex is the value of NL80211_ATTR_IFINDEX (0 if not present).
+ * timestamp is the receive time in nanoseconds since the epoch.
+ */
+struct iwraw_rec_hdr {
+	uint32_t len;
+	uint16_t type;
+	uint16_t cmd;
+	uint32_t seq;
+	int32_t status;
+	uint32_t ifindex;
+	uint32_t reserved;
+	uint64_t timestamp;
+};
+
+/*
+ * Payload of an IWRAW_REC_GAP record. The record is written when the
+ * kernel has dropped messages because the socket receive buffer
+ * overflowed (status is -ENOBUFS). The messages were lost somewhere
+ * between the previous record and this one.
+ * overruns is the total number of overruns detected so far.
+ */
+struct iwraw_rec_gap {
+	uint64_t overruns;
+};
+
+#endif /*_RECORD_H_*/
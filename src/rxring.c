@@ -0,0 +1,378 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Receive thread (--rx-ring).
+ *
+ * The receive thread does nothing but drain the netlink socket into a
+ * ring of preallocated slots. The main thread takes the messages from the
+ * ring and handles them (filters, output, statistics and so on) as usual.
+ * If the output stalls (a slow consumer on the other end of a pipe), the
+ * ring fills up instead of the socket receive buffer, so the kernel
+ * doesn't drop events until the ring is full as well.
+ *
+ * The ring is a lock free single producer, single consumer ring: head is
+ * only written by the receive thread and tail only by the main thread.
+ * A thread that has to wait (for a message or for a free slot) sets its
+ * waiting flag and sleeps on an eventfd, which the other thread only
+ * writes to when the flag is set.
+ *
+ * Messages larger than a slot are copied to a separate allocation.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <netlink/netlink.h>
+#include <netlink/msg.h>
+#include "iwraw.h"
+#include "log.h"
+
+#define RXRING_SLOTS_MAX (1024 * 1024)
+
+#define CACHELINE_ALIGNED __attribute__((aligned(64)))
+
+struct rxring {
+	struct nl_sock *sk;
+	struct nl_cb *cb;
+	pthread_t thread;
+	bool running;
+	struct rxring_slot *slots;
+	uint8_t *buf;
+	unsigned int n_slots;		/* Power of two */
+	/* Receive thread */
+	unsigned int head CACHELINE_ALIGNED;
+	unsigned long rx;		/* Messages received (per nl_recvmsgs) */
+	int rx_waiting;			/* Waiting for a free slot */
+	int space_fd;
+	/* Main thread */
+	unsigned int tail CACHELINE_ALIGNED;
+	int tx_waiting;			/* Waiting for a message */
+	int data_fd;
+	/* Statistics (written by the receive thread) */
+	unsigned int hwm CACHELINE_ALIGNED;
+	unsigned long full;
+	unsigned long large;
+};
+
+static struct rxring ring = {
+	.space_fd = -1,
+	.data_fd = -1,
+};
+
+static void rxring_wake(int fd)
+{
+	uint64_t val = 1;
+
+	(void) write(fd, &val, sizeof(val));
+}
+
+/* Sleep on fd (at most timeout ms) */
+static void rxring_sleep(int fd, int timeout)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
+	};
+	uint64_t val;
+
+	if (poll(&pfd, 1, timeout) > 0)
+		(void) read(fd, &val, sizeof(val));
+}
+
+/* Return the next free slot. Waits for the main thread if the ring is full */
+static struct rxring_slot *rxring_reserve(void)
+{
+	unsigned int tail;
+
+	for (;;) {
+		tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+		if (ring.head - tail < ring.n_slots)
+			break;
+
+		__atomic_store_n(&ring.rx_waiting, 1, __ATOMIC_SEQ_CST);
+		tail = __atomic_load_n(&ring.tail, __ATOMIC_SEQ_CST);
+		if (ring.head - tail == ring.n_slots) {
+			__atomic_store_n(&ring.full, ring.full + 1,
+					 __ATOMIC_RELAXED);
+			rxring_sleep(ring.space_fd, -1);
+		}
+		__atomic_store_n(&ring.rx_waiting, 0, __ATOMIC_RELAXED);
+	}
+
+	return &ring.slots[ring.head & (ring.n_slots - 1)];
+}
+
+/* Hand the slot returned by rxring_reserve() over to the main thread */
+static void rxring_commit(void)
+{
+	unsigned int used;
+
+	__atomic_store_n(&ring.head, ring.head + 1, __ATOMIC_SEQ_CST);
+
+	used = ring.head - __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+	if (used > ring.hwm)
+		__atomic_store_n(&ring.hwm, used, __ATOMIC_RELAXED);
+
+	if (__atomic_load_n(&ring.tx_waiting, __ATOMIC_SEQ_CST))
+		rxring_wake(ring.data_fd);
+}
+
+static void rxring_push_status(enum rxring_type type)
+{
+	struct rxring_slot *slot = rxring_reserve();
+
+	slot->type = type;
+	slot->overruns = sockbuf_overruns();
+	slot->timestamp = timestamp_ns();
+	slot->monotonic = monotonic_ns();
+	rxring_commit();
+}
+
+static int rxring_valid_handler(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *nlh = nlmsg_hdr(msg);
+	struct rxring_slot *slot;
+	void *large = NULL;
+
+	(void) arg;
+	ring.rx++;
+
+	if (nlh->nlmsg_len > RXRING_SLOT_SIZE) {
+		large = malloc(nlh->nlmsg_len);
+		if (!large) {
+			LOG_ERR_("Unable to allocate %u bytes. Message lost\n",
+				 nlh->nlmsg_len);
+			return NL_OK;
+		}
+	}
+
+	slot = rxring_reserve();
+	if (large) {
+		slot->nlh = large;
+		__atomic_store_n(&ring.large, ring.large + 1,
+				 __ATOMIC_RELAXED);
+	} else {
+		slot->nlh = (struct nlmsghdr *)
+			(ring.buf + (ring.head & (ring.n_slots - 1)) *
+			 RXRING_SLOT_SIZE);
+	}
+	memcpy(slot->nlh, nlh, nlh->nlmsg_len);
+	slot->type = RXRING_MSG;
+	slot->timestamp = nlrecv_timestamp();
+	slot->monotonic = nlrecv_monotonic();
+	rxring_commit();
+
+	return NL_OK;
+}
+
+static void *rxring_thread(void *arg)
+{
+	struct pollfd pfd;
+	bool hup = false;
+
+	(void) arg;
+	pfd.fd = transport_fd(ring.sk);
+	pfd.events = POLLIN;
+
+	for (;;) {
+		unsigned long prev_rx = ring.rx;
+		int err;
+
+		err = nl_recvmsgs(ring.sk, ring.cb);
+		/* See do_listen_events() */
+		if (err == -NLE_NOMEM) {
+			sockbuf_overrun(ring.sk);
+			rxring_push_status(RXRING_OVERRUN);
+			continue;
+		}
+		if (err == -NLE_AGAIN || (!err && ring.rx == prev_rx)) {
+			if (hup)
+				break;
+			if (poll(&pfd, 1, -1) > 0 && (pfd.revents & POLLHUP))
+				hup = true;
+		}
+	}
+
+	rxring_push_status(RXRING_HUP);
+
+	return NULL;
+}
+
+/* Free everything allocated by rxring_start() (but keep the statistics) */
+static void rxring_free(void)
+{
+	if (ring.cb)
+		nl_cb_put(ring.cb);
+	if (ring.space_fd >= 0)
+		close(ring.space_fd);
+	if (ring.data_fd >= 0)
+		close(ring.data_fd);
+	free(ring.slots);
+	free(ring.buf);
+	ring.cb = NULL;
+	ring.space_fd = -1;
+	ring.data_fd = -1;
+	ring.slots = NULL;
+	ring.buf = NULL;
+	ring.running = false;
+}
+
+/*
+ * Start receiving the messages of sk in the receive thread. The ring
+ * has room for (at least) slots messages.
+ */
+int rxring_start(struct nl_sock *sk, unsigned int slots)
+{
+	sigset_t set, old;
+	int ret;
+
+	if (slots < 1 || slots > RXRING_SLOTS_MAX) {
+		LOG_ERR_("Invalid number of receive ring slots: %u\n", slots);
+		return -EINVAL;
+	}
+
+	ring.sk = sk;
+	ring.head = 0;
+	ring.tail = 0;
+	ring.rx = 0;
+	ring.hwm = 0;
+	ring.full = 0;
+	ring.large = 0;
+	ring.n_slots = 1;
+	while (ring.n_slots < slots)
+		ring.n_slots <<= 1;
+
+	ret = -ENOMEM;
+	ring.slots = calloc(ring.n_slots, sizeof(*ring.slots));
+	ring.buf = malloc((size_t) ring.n_slots * RXRING_SLOT_SIZE);
+	ring.cb = nl_cb_alloc((log_level > LOG_WARNING) ?
+			      NL_CB_DEBUG : NL_CB_DEFAULT);
+	if (!ring.slots || !ring.buf || !ring.cb)
+		goto err;
+
+	ring.space_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ring.data_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ring.space_fd < 0 || ring.data_fd < 0) {
+		ret = -errno;
+		goto err;
+	}
+
+	nlrecv_setup(ring.cb);
+	nl_cb_set(ring.cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, no_seq_check, NULL);
+	nl_cb_set(ring.cb, NL_CB_VALID, NL_CB_CUSTOM, rxring_valid_handler,
+		  NULL);
+	transport_set_nonblocking(sk);
+
+	/* Signals (SIGUSR1 and so on) are handled by the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	ret = -pthread_create(&ring.thread, NULL, rxring_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret)
+		goto err;
+	ring.running = true;
+
+	LOG_INFO_("Receive thread started (%u slots)\n", ring.n_slots);
+
+	return 0;
+
+err:
+	LOG_ERR_("Unable to start the receive thread: %s\n", strerror(-ret));
+	rxring_free();
+	ring.n_slots = 0;
+
+	return ret;
+}
+
+/*
+ * Oldest message in the ring, or NULL if the ring is empty. The slot
+ * is valid until rxring_release().
+ */
+struct rxring_slot *rxring_peek(void)
+{
+	unsigned int head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+
+	if (head == ring.tail)
+		return NULL;
+
+	return &ring.slots[ring.tail & (ring.n_slots - 1)];
+}
+
+/* Done with the slot returned by rxring_peek() */
+void rxring_release(void)
+{
+	struct rxring_slot *slot = &ring.slots[ring.tail & (ring.n_slots - 1)];
+
+	if (slot->type == RXRING_MSG &&
+	    (uint8_t *) slot->nlh != ring.buf + (ring.tail & (ring.n_slots - 1)) *
+				     RXRING_SLOT_SIZE)
+		free(slot->nlh);
+
+	__atomic_store_n(&ring.tail, ring.tail + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring.rx_waiting, __ATOMIC_SEQ_CST))
+		rxring_wake(ring.space_fd);
+}
+
+/*
+ * Wait (at most timeout ms, or forever if timeout is negative) for a
+ * message. Also returns when a signal is received.
+ */
+void rxring_wait(int timeout)
+{
+	__atomic_store_n(&ring.tx_waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring.head, __ATOMIC_SEQ_CST) == ring.tail)
+		rxring_sleep(ring.data_fd, timeout);
+	__atomic_store_n(&ring.tx_waiting, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Wait for the receive thread to exit (it exits after a RXRING_HUP slot)
+ * and free the ring.
+ */
+void rxring_stop(void)
+{
+	if (!ring.running)
+		return;
+
+	pthread_join(ring.thread, NULL);
+	while (rxring_peek())
+		rxring_release();
+	rxring_free();
+}
+
+/*
+ * Ring statistics: the number of slots (0 if the receive thread isn't
+ * used), the max number of slots used at the same time, the number of
+ * times the receive thread had to wait for a free slot and the number
+ * of messages that didn't fit in a slot.
+ */
+void rxring_stats(unsigned int *slots, unsigned int *hwm, unsigned long *full,
+		  unsigned long *large)
+{
+	*slots = ring.n_slots;
+	*hwm = __atomic_load_n(&ring.hwm, __ATOMIC_RELAXED);
+	*full = __atomic_load_n(&ring.full, __ATOMIC_RELAXED);
+	*large = __atomic_load_n(&ring.large, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Netlink socket buffer sizing and overrun accounting.
+ *
+ * When the receive buffer of the socket overflows, the kernel drops the
+ * message and the next read fails with ENOBUFS. Each such overrun is
+ * counted, and the receive buffer is doubled (up to SOCKBUF_RCVBUF_MAX)
+ * to make further overruns less likely.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "iwraw.h"
+#include "log.h"
+
+/*
+ * With --rx-ring, these are updated in the receive thread and read (e.g.
+ * by the statistics) in the main thread. Hence the atomic accesses.
+ */
+static int cur_rcvbuf;
+static unsigned long overruns;
+
+/*
+ * Set a socket buffer size. SO_xxxBUFFORCE (which requires CAP_NET_ADMIN)
+ * is tried first, since it isn't limited by net.core.[rw]mem_max.
+ */
+static int set_buf(int fd, int force_opt, int opt, int size)
+{
+	if (!setsockopt(fd, SOL_SOCKET, force_opt, &size, sizeof(size)))
+		return 0;
+	if (setsockopt(fd, SOL_SOCKET, opt, &size, sizeof(size)))
+		return -errno;
+
+	return 0;
+}
+
+/* Actual size of a socket buffer (as reported by the kernel) */
+static int get_buf(int fd, int opt)
+{
+	socklen_t len = sizeof(int);
+	int size;
+
+	if (getsockopt(fd, SOL_SOCKET, opt, &size, &len))
+		return -errno;
+
+	return size;
+}
+
+static int set_rcvbuf(struct nl_sock *sk, int size)
+{
+	int fd = transport_fd(sk);
+	int ret, actual;
+
+	ret = set_buf(fd, SO_RCVBUFFORCE, SO_RCVBUF, size);
+	if (ret) {
+		LOG_ERR_("Unable to set receive buffer size: %s\n",
+			 strerror(-ret));
+		return ret;
+	}
+	__atomic_store_n(&cur_rcvbuf, size, __ATOMIC_RELAXED);
+
+	/* The kernel doubles the value (to allow space for bookkeeping) */
+	actual = get_buf(fd, SO_RCVBUF);
+	if (actual >= 0 && actual < 2 * size)
+		LOG_WARN_("Receive buffer limited to %d bytes (net.core.rmem_max)\n",
+			  actual / 2);
+	else
+		LOG_INFO_("Receive buffer size set to %d bytes\n", size);
+
+	return 0;
+}
+
+/* Set the receive and send buffer sizes of a connected socket */
+int sockbuf_init(struct nl_sock *sk, int rcvbuf, int sndbuf)
+{
+	int ret;
+
+	ret = set_rcvbuf(sk, rcvbuf);
+	if (ret)
+		return ret;
+
+	ret = set_buf(transport_fd(sk), SO_SNDBUFFORCE, SO_SNDBUF,
+		      sndbuf);
+	if (ret) {
+		LOG_ERR_("Unable to set send buffer size: %s\n",
+			 strerror(-ret));
+		return ret;
+	}
+
+	return 0;
+}
+
+/* Make sure the receive buffer is at least size bytes */
+int sockbuf_grow_rcvbuf(struct nl_sock *sk, int size)
+{
+	if (size <= __atomic_load_n(&cur_rcvbuf, __ATOMIC_RELAXED))
+		return 0;
+
+	return set_rcvbuf(sk, size);
+}
+
+/*
+ * Called when a receive buffer overrun (ENOBUFS) has been detected.
+ * One or more messages have been lost.
+ */
+void sockbuf_overrun(struct nl_sock *sk)
+{
+	unsigned long n = __atomic_add_fetch(&overruns, 1, __ATOMIC_RELAXED);
+	int rcvbuf = __atomic_load_n(&cur_rcvbuf, __ATOMIC_RELAXED);
+
+	if (rcvbuf < SOCKBUF_RCVBUF_MAX) {
+		LOG_WARN_("Receive buffer overrun (%lu in total). Growing buffer\n",
+			  n);
+		(void) set_rcvbuf(sk, rcvbuf < SOCKBUF_RCVBUF_MAX / 2 ?
+				  2 * rcvbuf : SOCKBUF_RCVBUF_MAX);
+	} else {
+		LOG_WARN_("Receive buffer overrun (%lu in total)\n", n);
+	}
+}
+
+/* Number of receive buffer overruns so far */
+unsigned long sockbuf_overruns(void)
+{
+	return __atomic_load_n(&overruns, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Runtime statistics.
+ *
+ * Per command counters, output counters and latency histograms are
+ * always collected (they are cheap). They are dumped when SIGUSR1 is
+ * received and periodically to a stats file.
+ *
+ * The histograms have one bucket per power of two nanoseconds.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netlink/msg.h>
+#include <netlink/genl/genl.h>
+#include "iwraw.h"
+#include "log.h"
+
+#define STATS_HIST_BUCKETS 64
+/* Output writes taking longer than this are counted as stalls */
+#define STATS_STALL_NS (10 * 1000000ULL)
+
+struct cmd_stats {
+	uint64_t rx;		/* Messages received */
+	uint64_t rx_bytes;
+	uint64_t filtered;	/* Messages dropped by the event filters */
+	uint64_t written;	/* Messages written to the output */
+	uint64_t written_bytes;
+	uint64_t requests;	/* Requests completed */
+	uint64_t errors;	/* Requests completed with an error */
+};
+
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[STATS_HIST_BUCKETS];
+};
+
+struct stats {
+	const char *path;
+	unsigned int interval_ms;
+	uint64_t next_dump_ns;
+	uint64_t start_ns;
+	/* Index NL80211_CMD_UNSPEC is used for unknown commands */
+	struct cmd_stats cmds[NL80211_CMD_MAX + 1];
+	uint64_t write_calls;
+	uint64_t write_bytes;
+	uint64_t write_ns;
+	uint64_t write_stalls;
+	struct hist hists[STATS_HIST_MAX];
+};
+
+static const char * const hist_names[STATS_HIST_MAX] = {
+	[STATS_HIST_RECV_WRITE] = "recv_to_write",
+	[STATS_HIST_FLUSH_DELAY] = "flush_delay",
+	[STATS_HIST_SEND_ACK] = "send_to_ack",
+};
+
+static struct stats stats;
+static volatile sig_atomic_t dump_requested;
+
+static void stats_signal_handler(int sig)
+{
+	(void) sig;
+	dump_requested = 1;
+}
+
+static struct cmd_stats *cmd_stats(unsigned int cmd)
+{
+	return &stats.cmds[cmd <= NL80211_CMD_MAX ? cmd : 0];
+}
+
+/*
+ * Set up the statistics. If path is given, the statistics are written
+ * to path every interval_s seconds (and on SIGUSR1), otherwise SIGUSR1
+ * writes them to stderr.
+ */
+void stats_init(const char *path, unsigned int interval_s)
+{
+	struct sigaction sa;
+
+	stats.path = path;
+	stats.interval_ms = path ? interval_s * 1000 : 0;
+	stats.start_ns = monotonic_ns();
+	stats.next_dump_ns = stats.start_ns +
+			     (uint64_t) stats.interval_ms * 1000000;
+
+	/* No SA_RESTART, so that blocking calls return and the dump is
+	 * written without waiting for the next message.
+	 */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stats_signal_handler;
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+/* A message has been received */
+void stats_rx(const struct nlmsghdr *nlh)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlh);
+	struct cmd_stats *cs = cmd_stats(gnlh->cmd);
+
+	cs->rx++;
+	cs->rx_bytes += nlh->nlmsg_len;
+}
+
+void stats_filtered(unsigned int cmd)
+{
+	cmd_stats(cmd)->filtered++;
+}
+
+/* len bytes of output have been produced for a message */
+void stats_written(unsigned int cmd, size_t len)
+{
+	struct cmd_stats *cs = cmd_stats(cmd);
+
+	cs->written++;
+	cs->written_bytes += len;
+}
+
+/* A request has completed with status */
+void stats_request(unsigned int cmd, int status)
+{
+	struct cmd_stats *cs = cmd_stats(cmd);
+
+	cs->requests++;
+	if (status)
+		cs->errors++;
+}
+
+/* An output write syscall of len bytes took ns nanoseconds */
+void stats_write(size_t len, uint64_t ns)
+{
+	stats.write_calls++;
+	stats.write_bytes += len;
+	stats.write_ns += ns;
+	if (ns >= STATS_STALL_NS)
+		stats.write_stalls++;
+}
+
+void stats_latency(enum stats_hist h, uint64_t ns)
+{
+	struct hist *hist = &stats.hists[h];
+	unsigned int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+	if (!hist->count || ns < hist->min)
+		hist->min = ns;
+	if (ns > hist->max)
+		hist->max = ns;
+	hist->count++;
+	hist->sum += ns;
+	hist->buckets[bucket]++;
+}
+
+/* Upper bound of the bucket holding the p:th percentile */
+static uint64_t hist_percentile(const struct hist *hist, double p)
+{
+	uint64_t n = 0, target = (uint64_t) (hist->count * p / 100.0);
+	unsigned int i;
+
+	for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+		n += hist->buckets[i];
+		if (n > target)
+			break;
+	}
+	if (i >= STATS_HIST_BUCKETS - 1)
+		return hist->max;
+
+	return (2ULL << i) < hist->max ? (2ULL << i) : hist->max;
+}
+
+static void stats_print(FILE *f)
+{
+	unsigned int i, j, slots, hwm;
+	unsigned long full, large;
+
+	fprintf(f, "timestamp %llu\n", (unsigned long long) timestamp_ns());
+	fprintf(f, "uptime_ms %llu\n",
+		(unsigned long long) (monotonic_ns() - stats.start_ns) /
+		1000000);
+	fprintf(f, "overruns %lu\n", sockbuf_overruns());
+	fprintf(f, "write_calls %llu\n", (unsigned long long) stats.write_calls);
+	fprintf(f, "write_bytes %llu\n", (unsigned long long) stats.write_bytes);
+	fprintf(f, "write_ns %llu\n", (unsigned long long) stats.write_ns);
+	fprintf(f, "write_stalls %llu\n",
+		(unsigned long long) stats.write_stalls);
+
+	rxring_stats(&slots, &hwm, &full, &large);
+	if (slots) {
+		fprintf(f, "rx_ring_slots %u\n", slots);
+		fprintf(f, "rx_ring_hwm %u\n", hwm);
+		fprintf(f, "rx_ring_full %lu\n", full);
+		fprintf(f, "rx_ring_large %lu\n", large);
+	}
+
+	for (i = 0; i <= NL80211_CMD_MAX; i++) {
+		const struct cmd_stats *cs = &stats.cmds[i];
+
+		if (!cs->rx && !cs->requests)
+			continue;
+		fprintf(f, "cmd %s rx %llu rx_bytes %llu filtered %llu written %llu written_bytes %llu requests %llu errors %llu\n",
+			i ? command_name(i) : "unknown",
+			(unsigned long long) cs->rx,
+			(unsigned long long) cs->rx_bytes,
+			(unsigned long long) cs->filtered,
+			(unsigned long long) cs->written,
+			(unsigned long long) cs->written_bytes,
+			(unsigned long long) cs->requests,
+			(unsigned long long) cs->errors);
+	}
+
+	for (i = 0; i < STATS_HIST_MAX; i++) {
+		const struct hist *hist = &stats.hists[i];
+
+		if (!hist->count)
+			continue;
+		fprintf(f, "hist %s count %llu min %llu avg %llu p50 %llu p99 %llu max %llu\n",
+			hist_names[i], (unsigned long long) hist->count,
+			(unsigned long long) hist->min,
+			(unsigned long long) (hist->sum / hist->count),
+			(unsigned long long) hist_percentile(hist, 50),
+			(unsigned long long) hist_percentile(hist, 99),
+			(unsigned long long) hist->max);
+		/* Buckets: [2^j, 2^(j+1)) ns */
+		for (j = 0; j < STATS_HIST_BUCKETS; j++) {
+			if (hist->buckets[j])
+				fprintf(f, "bucket %s %llu %llu\n",
+					hist_names[i], 1ULL << j,
+					(unsigned long long) hist->buckets[j]);
+		}
+	}
+}
+
+/* Write the statistics to the stats file (atomically) or stderr */
+static int stats_dump(void)
+{
+	char tmp_path[PATH_MAX];
+	FILE *f;
+	int ret = 0;
+
+	if (!stats.path) {
+		stats_print(stderr);
+		return 0;
+	}
+
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", stats.path) >=
+	    (int) sizeof(tmp_path))
+		return -ENAMETOOLONG;
+
+	f = fopen(tmp_path, "w");
+	if (!f)
+		return -errno;
+	stats_print(f);
+	if (fclose(f))
+		ret = -errno;
+
+	if (!ret && rename(tmp_path, stats.path))
+		ret = -errno;
+	if (ret) {
+		LOG_WARN_("Unable to write stats file %s: %s\n", stats.path,
+			  strerror(-ret));
+		(void) unlink(tmp_path);
+	}
+
+	return ret;
+}
+
+/*
+ * Time (in ms) until the next periodic dump is due, or -1 if there are
+ * no periodic dumps. Used as poll timeout.
+ */
+int stats_timeout(void)
+{
+	uint64_t now;
+
+	if (!stats.interval_ms)
+		return -1;
+
+	now = monotonic_ns();
+	if (now >= stats.next_dump_ns)
+		return 0;
+
+	return (stats.next_dump_ns - now + 999999) / 1000000;
+}
+
+/* Write the final statistics to the stats file (if any) */
+void stats_exit(void)
+{
+	if (stats.path)
+		(void) stats_dump();
+}
+
+/* Dump the statistics if requested (SIGUSR1) or if a periodic dump is due */
+void stats_poll(void)
+{
+	if (dump_requested) {
+		dump_requested = 0;
+		(void) stats_dump();
+	}
+
+	if (stats.interval_ms && !stats_timeout()) {
+		(void) stats_dump();
+		stats.next_dump_ns = monotonic_ns() +
+				     (uint64_t) stats.interval_ms * 1000000;
+	}
+}
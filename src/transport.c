@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Transport layer.
+ *
+ * All netlink I/O goes through the current transport: connecting,
+ * joining multicast groups and sending and receiving messages. Messages
+ * are still built and parsed with libnl (received messages are handed to
+ * libnl by nlrecv()).
+ *
+ * The netlink transport talks to the kernel. The mock transport (see
+ * mock.c) talks to a scripted fake kernel.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include <netlink/msg.h>
+#include <netlink/socket.h>
+#include <netlink/genl/genl.h>
+#include "iwraw.h"
+
+static int netlink_connect(struct nl_sock *sk)
+{
+	return genl_connect(sk);
+}
+
+static ssize_t netlink_recv(struct nl_sock *sk, struct msghdr *msg,
+			    int flags)
+{
+	return recvmsg(nl_socket_get_fd(sk), msg, flags);
+}
+
+static const struct transport netlink_transport = {
+	.name = "netlink",
+	.connect = netlink_connect,
+	.add_membership = nl_socket_add_membership,
+	.send = nl_send_auto_complete,
+	.recv = netlink_recv,
+	.fd = nl_socket_get_fd,
+};
+
+static const struct transport *transport = &netlink_transport;
+
+void transport_set(const struct transport *t)
+{
+	transport = t;
+}
+
+const char *transport_name(void)
+{
+	return transport->name;
+}
+
+int transport_connect(struct nl_sock *sk)
+{
+	return transport->connect(sk);
+}
+
+void transport_close(struct nl_sock *sk)
+{
+	if (transport->close)
+		transport->close(sk);
+}
+
+int transport_add_membership(struct nl_sock *sk, int group)
+{
+	return transport->add_membership(sk, group);
+}
+
+/*
+ * Complete (sequence number, port id and flags) and send a message.
+ * Returns the number of bytes sent or a negative libnl error code.
+ */
+int transport_send(struct nl_sock *sk, struct nl_msg *msg)
+{
+	return transport->send(sk, msg);
+}
+
+/* recvmsg() on the transport. Returns -1 and sets errno on failure. */
+ssize_t transport_recv(struct nl_sock *sk, struct msghdr *msg, int flags)
+{
+	return transport->recv(sk, msg, flags);
+}
+
+/* File descriptor to poll() for received messages */
+int transport_fd(struct nl_sock *sk)
+{
+	return transport->fd(sk);
+}
+
+int transport_set_nonblocking(struct nl_sock *sk)
+{
+	int fd = transport_fd(sk);
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -errno;
+
+	return 0;
+}
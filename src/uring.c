@@ -0,0 +1,550 @@
+/*
+ * Copyright (C) 2016  Erik Stromdahl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * io_uring receive and output backend (--io-uring).
+ *
+ * A number of receive buffers are kept posted on the netlink socket, so
+ * that datagrams are received while the previous ones are handled, and
+ * output buffers (see output.c) are written asynchronously. Buffers are
+ * re-posted and writes submitted in batches, with the same
+ * io_uring_enter() call that waits for the next completion.
+ *
+ * Writes are submitted one at a time (in order), since the output is
+ * normally a pipe. Short writes are resubmitted.
+ *
+ * The raw system calls are used (no liburing). Kernel 5.11 or later
+ * (IORING_FEAT_EXT_ARG) is required. If io_uring is unavailable,
+ * uring_start() fails and the normal receive path is used.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "iwraw.h"
+#include <iwraw_config.h>
+
+#ifdef HAVE_IO_URING_EXT_ARG
+
+#include "log.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+/* Receive buffer size (see nlrecv.c) */
+#define URING_RECV_BUF_SIZE (64 * 1024)
+#define URING_RECV_MAX 64
+#define URING_WRITES_MAX 16
+/* user_data of writes and cancel requests (receives use the index) */
+#define URING_UD_WRITE (~0ULL)
+#define URING_UD_CANCEL (~1ULL)
+
+struct uring_recv {
+	uint8_t *buf;
+	bool posted;
+	/* Completion (while on the ready list) */
+	int res;
+	uint64_t ts;
+	uint64_t mono;
+};
+
+struct uring_write {
+	int fd;
+	const uint8_t *buf;
+	size_t len;
+	size_t done;
+	uint64_t start_ns;
+};
+
+struct uring {
+	int fd;
+	int sock;
+	/* Submission queue */
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int sq_entries;
+	/* Completion queue */
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Receive buffers */
+	struct uring_recv recv[URING_RECV_MAX];
+	unsigned int n_recv;
+	unsigned int n_posted;
+	/* Completed receives, in completion order */
+	unsigned int ready[URING_RECV_MAX];
+	unsigned int ready_head;
+	unsigned int ready_len;
+	/* Writes, in order. writes[write_head] is in flight */
+	struct uring_write writes[URING_WRITES_MAX];
+	unsigned int write_head;
+	unsigned int n_writes;
+	bool write_busy;
+};
+
+static struct uring ur = {
+	.fd = -1,
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags,
+			      void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, arg, argsz);
+}
+
+/* SQEs not yet consumed by the kernel */
+static unsigned int uring_to_submit(void)
+{
+	return *ur.sq_tail - __atomic_load_n(ur.sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Get a zeroed SQE. There is always room (see uring_start()) */
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+	unsigned int tail = *ur.sq_tail;
+	unsigned int idx = tail & *ur.sq_mask;
+	struct io_uring_sqe *sqe = &ur.sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	ur.sq_array[idx] = idx;
+
+	return sqe;
+}
+
+/* Queue the SQE returned by uring_get_sqe() */
+static void uring_queue_sqe(void)
+{
+	__atomic_store_n(ur.sq_tail, *ur.sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+static void uring_post_recv(unsigned int i)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = ur.sock;
+	sqe->addr = (uintptr_t) ur.recv[i].buf;
+	sqe->len = URING_RECV_BUF_SIZE;
+	/* Return the real length of truncated datagrams */
+	sqe->msg_flags = MSG_TRUNC;
+	sqe->user_data = i;
+	uring_queue_sqe();
+	ur.recv[i].posted = true;
+	ur.n_posted++;
+}
+
+/* Submit the next part of the oldest write */
+static void uring_submit_write(void)
+{
+	struct uring_write *w = &ur.writes[ur.write_head];
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = w->fd;
+	sqe->addr = (uintptr_t) (w->buf + w->done);
+	sqe->len = w->len - w->done;
+	/* Current file position (or none, for pipes) */
+	sqe->off = (uint64_t) -1;
+	sqe->user_data = URING_UD_WRITE;
+	uring_queue_sqe();
+	ur.write_busy = true;
+}
+
+static void uring_write_complete(int res)
+{
+	struct uring_write *w = &ur.writes[ur.write_head];
+
+	ur.write_busy = false;
+	if (res == -EINTR || res == -EAGAIN) {
+		uring_submit_write();
+		return;
+	}
+	if (!res)
+		res = -EIO;
+	if (res > 0) {
+		w->done += res;
+		if (w->done < w->len) {
+			uring_submit_write();
+			return;
+		}
+	}
+
+	output_write_done(w->buf, w->len, res < 0 ? res : 0,
+			  monotonic_ns() - w->start_ns);
+	ur.write_head = (ur.write_head + 1) % URING_WRITES_MAX;
+	ur.n_writes--;
+	if (ur.n_writes)
+		uring_submit_write();
+}
+
+/* Handle all available completions */
+static void uring_reap(void)
+{
+	unsigned int head = *ur.cq_head;
+	unsigned int tail = __atomic_load_n(ur.cq_tail, __ATOMIC_ACQUIRE);
+	uint64_t now = 0, mono = 0;
+
+	for (; head != tail; head++) {
+		const struct io_uring_cqe *cqe = &ur.cqes[head & *ur.cq_mask];
+		struct uring_recv *r;
+
+		if (cqe->user_data == URING_UD_WRITE) {
+			uring_write_complete(cqe->res);
+			continue;
+		}
+		if (cqe->user_data == URING_UD_CANCEL ||
+		    cqe->user_data >= ur.n_recv)
+			continue;
+
+		/* The receive time is taken when the completion is seen
+		 * (like nlrecv() does after recvmsg())
+		 */
+		if (!now) {
+			now = timestamp_ns();
+			mono = monotonic_ns();
+		}
+		r = &ur.recv[cqe->user_data];
+		r->posted = false;
+		r->res = cqe->res;
+		r->ts = now;
+		r->mono = mono;
+		ur.n_posted--;
+		ur.ready[(ur.ready_head + ur.ready_len) % URING_RECV_MAX] =
+			cqe->user_data;
+		ur.ready_len++;
+	}
+	__atomic_store_n(ur.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Submit the queued requests and wait (at most timeout ms, or forever if
+ * timeout is negative) for a completion. Also returns when a signal is
+ * received.
+ */
+void uring_wait(int timeout)
+{
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout / 1000,
+		.tv_nsec = (timeout % 1000) * 1000000LL,
+	};
+	struct io_uring_getevents_arg arg = {
+		.ts = timeout >= 0 ? (uintptr_t) &ts : 0,
+	};
+	int ret;
+
+	/* Only wait for new completions */
+	uring_reap();
+	ret = sys_io_uring_enter(ur.fd, uring_to_submit(), 1,
+				 IORING_ENTER_GETEVENTS |
+				 IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if (ret < 0 && errno != EINTR && errno != ETIME)
+		LOG_ERR_("io_uring_enter failed: %s\n", strerror(errno));
+	uring_reap();
+}
+
+/*
+ * Next received datagram. Returns its length (the real length, which may
+ * be larger than the buffer if the datagram was truncated), 0 if the
+ * socket has been closed and -EAGAIN if nothing has been received.
+ * Receive errors (e.g. -ENOBUFS) are returned as negative values.
+ * *buf is valid until uring_recv_done(). *ts and *mono are the receive
+ * time (timestamp_ns() and monotonic_ns()).
+ */
+ssize_t uring_recv(uint8_t **buf, size_t *size, uint64_t *ts,
+		   uint64_t *mono)
+{
+	struct uring_recv *r;
+
+	if (!ur.ready_len)
+		uring_reap();
+	if (!ur.ready_len && uring_to_submit()) {
+		/* Repost the buffers. Receives complete immediately if
+		 * there is more to receive.
+		 */
+		(void) sys_io_uring_enter(ur.fd, uring_to_submit(), 0, 0,
+					  NULL, 0);
+		uring_reap();
+	}
+	if (!ur.ready_len)
+		return -EAGAIN;
+
+	r = &ur.recv[ur.ready[ur.ready_head]];
+	*buf = r->buf;
+	*size = URING_RECV_BUF_SIZE;
+	*ts = r->ts;
+	*mono = r->mono;
+
+	return r->res;
+}
+
+/* Done with the datagram returned by uring_recv(). The buffer is reposted */
+void uring_recv_done(void)
+{
+	unsigned int i = ur.ready[ur.ready_head];
+
+	ur.ready_head = (ur.ready_head + 1) % URING_RECV_MAX;
+	ur.ready_len--;
+	uring_post_recv(i);
+}
+
+/*
+ * Write len bytes of buf to fd asynchronously. output_write_done() is
+ * called when the write has completed. buf must stay valid until then.
+ */
+int uring_write(int fd, const void *buf, size_t len)
+{
+	struct uring_write *w;
+
+	while (ur.n_writes == URING_WRITES_MAX)
+		uring_wait(-1);
+
+	w = &ur.writes[(ur.write_head + ur.n_writes) % URING_WRITES_MAX];
+	w->fd = fd;
+	w->buf = buf;
+	w->len = len;
+	w->done = 0;
+	w->start_ns = monotonic_ns();
+	ur.n_writes++;
+	if (!ur.write_busy)
+		uring_submit_write();
+
+	return 0;
+}
+
+/* Wait until all writes have completed */
+void uring_write_sync(void)
+{
+	while (ur.n_writes)
+		uring_wait(-1);
+}
+
+static void uring_free(void)
+{
+	unsigned int i;
+
+	if (ur.sqes)
+		munmap(ur.sqes, ur.sqes_size);
+	if (ur.cq_ring && ur.cq_ring != ur.sq_ring)
+		munmap(ur.cq_ring, ur.cq_ring_size);
+	if (ur.sq_ring)
+		munmap(ur.sq_ring, ur.sq_ring_size);
+	if (ur.fd >= 0)
+		close(ur.fd);
+	for (i = 0; i < ur.n_recv; i++)
+		free(ur.recv[i].buf);
+	memset(&ur, 0, sizeof(ur));
+	ur.fd = -1;
+}
+
+/*
+ * Set up io_uring for receiving from the socket sock with n_recv
+ * buffers posted. The socket must be blocking.
+ */
+int uring_start(int sock, unsigned int n_recv)
+{
+	struct io_uring_params p;
+	unsigned int i;
+	int ret;
+
+	if (n_recv < 1 || n_recv > URING_RECV_MAX)
+		return -EINVAL;
+
+	memset(&p, 0, sizeof(p));
+	/* Room for all receives, a write and a cancel per receive */
+	ur.fd = sys_io_uring_setup(2 * n_recv + 1, &p);
+	if (ur.fd < 0) {
+		ret = -errno;
+		ur.fd = -1;
+		return ret;
+	}
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		ret = -EOPNOTSUPP;
+		goto err;
+	}
+
+	ur.sq_entries = p.sq_entries;
+	ur.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ur.cq_ring_size = p.cq_off.cqes +
+			  p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur.cq_ring_size > ur.sq_ring_size)
+			ur.sq_ring_size = ur.cq_ring_size;
+		ur.cq_ring_size = ur.sq_ring_size;
+	}
+
+	ur.sq_ring = mmap(NULL, ur.sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ur.fd, IORING_OFF_SQ_RING);
+	if (ur.sq_ring == MAP_FAILED) {
+		ur.sq_ring = NULL;
+		ret = -errno;
+		goto err;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur.cq_ring = ur.sq_ring;
+	} else {
+		ur.cq_ring = mmap(NULL, ur.cq_ring_size,
+				  PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, ur.fd,
+				  IORING_OFF_CQ_RING);
+		if (ur.cq_ring == MAP_FAILED) {
+			ur.cq_ring = NULL;
+			ret = -errno;
+			goto err;
+		}
+	}
+	ur.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur.sqes = mmap(NULL, ur.sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, ur.fd, IORING_OFF_SQES);
+	if (ur.sqes == MAP_FAILED) {
+		ur.sqes = NULL;
+		ret = -errno;
+		goto err;
+	}
+
+	ur.sq_head = (unsigned int *) ((uint8_t *) ur.sq_ring + p.sq_off.head);
+	ur.sq_tail = (unsigned int *) ((uint8_t *) ur.sq_ring + p.sq_off.tail);
+	ur.sq_mask = (unsigned int *)
+		((uint8_t *) ur.sq_ring + p.sq_off.ring_mask);
+	ur.sq_array = (unsigned int *)
+		((uint8_t *) ur.sq_ring + p.sq_off.array);
+	ur.cq_head = (unsigned int *) ((uint8_t *) ur.cq_ring + p.cq_off.head);
+	ur.cq_tail = (unsigned int *) ((uint8_t *) ur.cq_ring + p.cq_off.tail);
+	ur.cq_mask = (unsigned int *)
+		((uint8_t *) ur.cq_ring + p.cq_off.ring_mask);
+	ur.cqes = (struct io_uring_cqe *)
+		((uint8_t *) ur.cq_ring + p.cq_off.cqes);
+
+	ur.sock = sock;
+	for (i = 0; i < n_recv; i++) {
+		ur.recv[i].buf = malloc(URING_RECV_BUF_SIZE);
+		if (!ur.recv[i].buf) {
+			ret = -ENOMEM;
+			goto err;
+		}
+		ur.n_recv++;
+	}
+	for (i = 0; i < n_recv; i++)
+		uring_post_recv(i);
+
+	LOG_INFO_("Using io_uring (%u receive buffers)\n", n_recv);
+
+	return 0;
+
+err:
+	uring_free();
+
+	return ret;
+}
+
+/* Wait for all writes, cancel the posted receives and free everything */
+void uring_stop(void)
+{
+	unsigned int i;
+
+	if (ur.fd < 0)
+		return;
+
+	uring_write_sync();
+
+	for (i = 0; i < ur.n_recv; i++) {
+		struct io_uring_sqe *sqe;
+
+		if (!ur.recv[i].posted)
+			continue;
+		sqe = uring_get_sqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = i;
+		sqe->user_data = URING_UD_CANCEL;
+		uring_queue_sqe();
+	}
+	/* The buffers can't be freed until the receives are gone */
+	while (ur.n_posted)
+		uring_wait(-1);
+
+	uring_free();
+}
+
+#else /* HAVE_IO_URING_EXT_ARG */
+
+int uring_start(int sock, unsigned int n_recv)
+{
+	(void) sock;
+	(void) n_recv;
+
+	return -ENOSYS;
+}
+
+void uring_stop(void)
+{
+}
+
+void uring_wait(int timeout)
+{
+	(void) timeout;
+}
+
+ssize_t uring_recv(uint8_t **buf, size_t *size, uint64_t *ts,
+		   uint64_t *mono)
+{
+	(void) buf;
+	(void) size;
+	(void) ts;
+	(void) mono;
+
+	return -EAGAIN;
+}
+
+void uring_recv_done(void)
+{
+}
+
+int uring_write(int fd, const void *buf, size_t len)
+{
+	(void) fd;
+	(void) buf;
+	(void) len;
+
+	return -ENOSYS;
+}
+
+void uring_write_sync(void)
+{
+}
+
+#endif /* HAVE_IO_URING_EXT_ARG */